@@ -94,6 +94,18 @@ namespace lox {
             return True{};
         case OpCode::False:
             return False{};
+        case OpCode::InlineGuard:
+            return InlineGuard{buffer};
+        case OpCode::InlineReturn:
+            return InlineReturn{buffer};
+        case OpCode::Peek:
+            return Peek{buffer};
+        case OpCode::LocalFunction:
+            return LocalFunctionOp(buffer, chunk);
+        case OpCode::GetOuterLocal:
+            return GetOuterLocal{buffer};
+        case OpCode::SetOuterLocal:
+            return SetOuterLocal{buffer};
         default:
             return Unknown{buffer};
         }
@@ -116,13 +128,13 @@ namespace lox {
     }
 
     std::vector<Function::UpValue> getUpValues(const Chunk* chunk, size_t index) {
-        auto func = std::get<SharedPtr<Function>>(chunk->getConstant(index));
+        auto func = as<SharedPtr<Function>>(chunk->getConstant(index));
         auto uvs = func->getUpvalues();
         return std::vector<Function::UpValue>{uvs.begin(), uvs.end()};
     }
 
+    // decoding waits until the instruction is looked at, an iterator at the end has nothing to decode
     Chunk::InstructionIterator::InstructionIterator(Vector<std::byte>::const_iterator it, const Chunk* chunk) : current(it), chunk(chunk) {
-        parseInstruction();
     }
 
     // Dereference operator
@@ -151,15 +163,14 @@ namespace lox {
         current -= index;
         offset -= index;
         parsed = false;
-        parseInstruction();
     }
 
     Chunk::InstructionIterator& Chunk::InstructionIterator::operator+=(size_t v) {
         int bytesToRead = v;
         while (bytesToRead > 0) {
+            parseInstruction();
             bytesToRead -= this->instruction.size();
             ++*this;
-            parseInstruction();
         }
         if (bytesToRead != 0) {
             throw lox::Exception("Jumping to middle of instruction", nullptr);
@@ -223,6 +234,18 @@ namespace lox {
         throw Exception("Instruction not found while getting line number", nullptr);
     }
 
+    const Chunk::Inlined* Chunk::inlinedAt(size_t offset) const {
+        for (const auto& inlined : inlinedBodies) {
+            if (offset < inlined.start) {
+                return nullptr;
+            }
+            if (offset < inlined.end) {
+                return &inlined;
+            }
+        }
+        return nullptr;
+    }
+
     Chunk::InstructionIterator Chunk::begin() const {
         return InstructionIterator(data.begin(), this);
     }
@@ -261,7 +284,7 @@ namespace lox {
         write(static_cast<uint8_t>(val & 0xFF), line);
     }
 
-    Value Chunk::getConstant(size_t index) const {
+    const Value& Chunk::getConstant(size_t index) const {
         return values[index];
     }
     template <>
@@ -57,6 +57,12 @@ namespace lox {
         SetUpValue,
         LongSetGlobal,
         Subtract,
+        InlineGuard,
+        InlineReturn,
+        Peek,
+        LocalFunction,
+        GetOuterLocal,
+        SetOuterLocal,
         Unknown
     };
 
@@ -111,6 +117,22 @@ namespace lox {
         std::vector<Function::UpValue> upvalues;
     };
 
+    // same layout as a closure, but for a local function that never escapes its frame
+    // so it is pushed as a plain function and reads its captures from the frame instead
+    class LocalFunctionOp : public _OpAndValueInstruction<uint8_t> {
+    public:
+        LocalFunctionOp(const std::byte* buffer, const Chunk* chunk) : _OpAndValueInstruction<uint8_t>(buffer, OpCode::LocalFunction, "OP_LOCAL_FUNCTION"), upvalues(lox::getUpValues(chunk, value())) {
+            size = 2 + 2 * upvalues.size();
+        }
+
+        const std::vector<Function::UpValue>& getUpValues() const {
+            return upvalues;
+        }
+
+    private:
+        std::vector<Function::UpValue> upvalues;
+    };
+
     class Invoke : public _OpAndValueInstruction<uint8_t> {
     public:
         Invoke(const std::byte* buffer) : _OpAndValueInstruction<uint8_t>(buffer, OpCode::Invoke, "OP_INVOKE"), argCount(uint8_t(*(buffer + 2))) {
@@ -212,6 +234,43 @@ namespace lox {
         SetUpValue(const std::byte* buffer) : _OpAndValueInstruction<uint8_t>(buffer, OpCode::SetUpValue, "OP_SET_UPVALUE") {}
     };
 
+    // guards an inlined call: jumps to the regular call when the callee isn't the inlined function
+    class InlineGuard : public _OpAndValueInstruction<uint16_t> {
+    public:
+        InlineGuard(const std::byte* buffer) : _OpAndValueInstruction<uint16_t>(buffer, OpCode::InlineGuard, "OP_INLINE_GUARD"), argCount(uint8_t(*(buffer + 3))), constant(uint8_t(*(buffer + 4))) {
+            size = 5;
+        }
+        uint8_t getArgumentCount() const {
+            return argCount;
+        }
+        uint8_t getConstant() const {
+            return constant;
+        }
+
+    private:
+        uint8_t argCount;
+        uint8_t constant;
+    };
+    class InlineReturn : public _OpAndValueInstruction<uint8_t> {
+    public:
+        InlineReturn(const std::byte* buffer) : _OpAndValueInstruction<uint8_t>(buffer, OpCode::InlineReturn, "OP_INLINE_RETURN") {}
+    };
+    // pushes a copy of the value this far down the stack
+    class Peek : public _OpAndValueInstruction<uint8_t> {
+    public:
+        Peek(const std::byte* buffer) : _OpAndValueInstruction<uint8_t>(buffer, OpCode::Peek, "OP_PEEK") {}
+    };
+
+    // locals of the frame that called a local function, used instead of upvalues when it doesn't escape
+    class GetOuterLocal : public _OpAndValueInstruction<uint8_t> {
+    public:
+        GetOuterLocal(const std::byte* buffer) : _OpAndValueInstruction<uint8_t>(buffer, OpCode::GetOuterLocal, "OP_GET_OUTER_LOCAL") {}
+    };
+    class SetOuterLocal : public _OpAndValueInstruction<uint8_t> {
+    public:
+        SetOuterLocal(const std::byte* buffer) : _OpAndValueInstruction<uint8_t>(buffer, OpCode::SetOuterLocal, "OP_SET_OUTER_LOCAL") {}
+    };
+
     class Equal : public _Instruction {
     public:
         Equal() : _Instruction(OpCode::Equal, 1, "OP_EQUAL") {}
@@ -374,7 +433,8 @@ namespace lox {
         using InstVariant = std::variant<Binary, BinaryPredicate, Call, ClassOp, ClosureOp, Constant, DefineGlobal, GetGlobal, Equal, False, LongConstant,
                                          LongDefineGlobal, LongGetGlobal, Negate, Nil, Not, Print, Pop, Return, MethodOp, SetGlobal, LongSetGlobal, GetLocal,
                                          SetLocal, GetUpValue, SetUpValue, JumpIfFalse, Jump, Loop, True, CloseUpValue, GetProperty, SetProperty, Unknown, Invoke,
-                                         Initializer, Inherit, GetSuper, SuperInvoke>;
+                                         Initializer, Inherit, GetSuper, SuperInvoke, InlineGuard, InlineReturn, Peek,
+                                         LocalFunctionOp, GetOuterLocal, SetOuterLocal>;
         InstVariant instruction() const;
         size_t offset() const;
         size_t size() const;
@@ -408,6 +468,11 @@ namespace lox {
 
             Instruction* operator->();
 
+            // bytes from the start of the chunk
+            size_t getOffset() const {
+                return offset;
+            }
+
             friend ptrdiff_t operator-(const InstructionIterator& lhs, const InstructionIterator& rhs) {
                 return lhs.current - rhs.current;
             }
@@ -429,11 +494,31 @@ namespace lox {
         void write(size_t value, size_t line);
         void writeConstant(Value value, size_t line);
         void writeOpAndIndex(OpCode small, OpCode large, size_t value, size_t line);
-        Value getConstant(size_t index) const;
+        const Value& getConstant(size_t index) const;
+        size_t getConstantCount() const {
+            return values.size();
+        }
 
         size_t addConstant(Value value);
+        // drops the constants added since the pool had count of them
+        void truncateConstants(size_t count) {
+            values.truncate(count);
+        }
         size_t getLineNumber(size_t offset) const;
 
+        // the bytes in [start, end) are a copy of the body of the function at constant callee
+        struct Inlined {
+            size_t start = 0;
+            size_t end = 0;
+            size_t callee = 0;
+            size_t callLine = 0;  // the caller's line, the body's instructions have the callee's
+        };
+        void addInlined(Inlined inlined) {
+            inlinedBodies.push_back(inlined);
+        }
+        // the inlined body the instruction at offset is part of, if it is in one
+        const Inlined* inlinedAt(size_t offset) const;
+
         InstructionIterator begin() const;
 
         InstructionIterator end() const;
@@ -446,6 +531,7 @@ namespace lox {
         // so we have two sixteen bit fields in our uint32_t
         Vector<uint32_t> lines;
         Vector<Value> values;
+        Vector<Inlined> inlinedBodies;  // in the order they were written
     };
 }  // namespace lox
 
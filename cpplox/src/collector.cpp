@@ -0,0 +1,603 @@
+#include "collector.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace lox {
+    // the gray objects of one marking thread. The owner works from the top and a thread that has run
+    // out takes half from the bottom. It uses std::vector, as the arena can't be used from two threads
+    class MarkStack {
+    public:
+        void push(Traced* object) {
+            std::lock_guard lock(mutex);
+            items.push_back(object);
+        }
+
+        Traced* pop() {
+            std::lock_guard lock(mutex);
+            if (bottom == items.size()) {
+                return nullptr;
+            }
+            auto object = items.back();
+            items.pop_back();
+            resetIfEmpty();
+            return object;
+        }
+
+        bool empty() const {
+            std::lock_guard lock(mutex);
+            return bottom == items.size();
+        }
+
+        bool stealFrom(MarkStack& victim) {
+            std::scoped_lock lock(mutex, victim.mutex);
+            size_t available = victim.items.size() - victim.bottom;
+            if (available == 0) {
+                return false;
+            }
+            auto first = victim.items.begin() + ptrdiff_t(victim.bottom);
+            auto count = (available + 1) / 2;
+            items.insert(items.end(), first, first + ptrdiff_t(count));
+            victim.bottom += count;
+            victim.resetIfEmpty();
+            return true;
+        }
+
+    private:
+        void resetIfEmpty() {
+            if (bottom == items.size()) {
+                items.clear();
+                bottom = 0;
+            }
+        }
+
+        mutable std::mutex mutex;
+        std::vector<Traced*> items;
+        size_t bottom = 0;
+    };
+
+    // set on the threads of a parallel trace, where marking goes to the thread's own stack
+    static thread_local MarkStack* markStack = nullptr;
+
+    // The threads that help the collector's own with a parallel trace. They are started the first
+    // time they are needed and wait between collections, rather than being started for each one
+    class MarkWorkers {
+    public:
+        using Job = std::function<void(size_t)>;
+
+        ~MarkWorkers() {
+            {
+                std::lock_guard lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+        }
+
+        // runs job on the calling thread as 0 and on helpers 1 to count - 1, returns once all are done
+        void run(size_t count, const Job& job) {
+            {
+                std::lock_guard lock(mutex);
+                while (workers.size() < count - 1) {
+                    workers.emplace_back(&MarkWorkers::wait, this, workers.size() + 1);
+                }
+                current = &job;
+                helpers = count - 1;
+                running = count - 1;
+                round++;
+            }
+            wake.notify_all();
+            job(0);
+            std::unique_lock lock(mutex);
+            done.wait(lock, [this] { return running == 0; });
+            current = nullptr;
+        }
+
+    private:
+        void wait(size_t self) {
+            size_t seen = 0;
+            std::unique_lock lock(mutex);
+            while (true) {
+                wake.wait(lock, [this, seen] { return stopping || round != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = round;
+                if (self > helpers) {
+                    continue;
+                }
+                lock.unlock();
+                (*current)(self);
+                lock.lock();
+                if (--running == 0) {
+                    done.notify_one();
+                }
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        const Job* current = nullptr;
+        size_t helpers = 0;  // how many of the workers this round uses
+        size_t running = 0;
+        size_t round = 0;
+        bool stopping = false;
+        std::vector<std::jthread> workers;  // last, so they are joined before the rest goes
+    };
+
+    static MarkWorkers markWorkers;
+
+    Traced::Traced() {
+        collector.track(this);
+    }
+
+    Traced::Traced(const Traced&) : Traced() {
+    }
+
+    Traced& Traced::operator=(const Traced&) {
+        return *this;  // the registry links belong to the object, not its contents
+    }
+
+    Traced::~Traced() {
+        expireWeakRef();
+        collector.untrack(this);
+    }
+
+    void Graveyard::bury(Value value) {
+        values.push_back(std::move(value));
+    }
+
+    void Graveyard::bury(Callable callable) {
+        std::visit([this](auto& f) { bury(Value{std::move(f)}); }, callable);
+    }
+
+    void Graveyard::clear() {
+        values.clear();
+    }
+
+    void Traced::barrier() {
+        collector.written(this);
+    }
+
+    void Traced::buffer() {
+        collector.buffer(this);
+    }
+
+    void Collector::link(Traced*& list, Traced* object) {
+        object->previous = nullptr;
+        object->next = list;
+        if (list) {
+            list->previous = object;
+        }
+        list = object;
+    }
+
+    void Collector::unlink(Traced*& list, Traced* object) {
+        if (object->previous) {
+            object->previous->next = object->next;
+        } else {
+            list = object->next;
+        }
+        if (object->next) {
+            object->next->previous = object->previous;
+        }
+    }
+
+    void Collector::track(Traced* object) {
+        assert(onOwnerThread());
+        if (phase == Phase::Sweeping) {
+            // made behind the sweep, so it waits for the next full collection to be looked at
+            object->old = true;
+            link(old, object);
+            return;
+        }
+        link(young, object);
+        if (phase == Phase::Marking) {
+            mark(object);  // gray, it is traced once it holds what it was made with
+        }
+    }
+
+    void Collector::untrack(Traced* object) {
+        assert(onOwnerThread());
+        if (object == sweepCursor) {
+            sweepCursor = object->next;
+        }
+        unlink(object->old ? old : young, object);
+        if (object->grayIndex != Traced::NOT_GRAY) {
+            removeGray(object);
+        }
+        if (object->candidateIndex != Traced::NOT_BUFFERED) {
+            auto last = candidates.back();
+            candidates[object->candidateIndex] = last;
+            last->candidateIndex = object->candidateIndex;
+            candidates.truncate(candidates.size() - 1);
+        }
+        if (object->remembered) {
+            for (auto entry = &remembered; *entry; entry = &(*entry)->nextRemembered) {
+                if (*entry == object) {
+                    *entry = object->nextRemembered;
+                    break;
+                }
+            }
+        }
+    }
+
+    void Collector::written(Traced* object) {
+        if (object->old && !object->remembered) {
+            object->remembered = true;
+            object->nextRemembered = remembered;
+            remembered = object;
+        }
+        // already traced, it has to be traced again for what it points at now to be marked
+        if (Traced::marking && object->marked && object->grayIndex == Traced::NOT_GRAY) {
+            pushGray(object);
+        }
+    }
+
+    // borrowed rather than copied, the marking threads must leave the counts alone
+    void Collector::mark(const Value& value) {
+        if (gathering) {
+            gathering->push_back(value);
+            return;
+        }
+        if (is<SharedPtr<Instance>>(value)) {
+            mark(borrow<Instance>(value));
+        } else if (is<SharedPtr<Closure>>(value)) {
+            mark(borrow<Closure>(value));
+        } else if (is<SharedPtr<Class>>(value)) {
+            mark(borrow<Class>(value));
+        } else if (is<SharedPtr<BoundMethod>>(value)) {
+            mark(borrow<BoundMethod>(value));
+        } else if (is<SharedPtr<UpValueObj>>(value)) {
+            mark(borrow<UpValueObj>(value));
+        } else if (is<SharedPtr<WeakMap>>(value)) {
+            mark(borrow<WeakMap>(value));
+        }
+    }
+
+    void Collector::mark(const Callable& callable) {
+        if (gathering) {
+            std::visit([this](const auto& function) { gathering->push_back(Value{function}); }, callable);
+            return;
+        }
+        if (std::holds_alternative<SharedPtr<Closure>>(callable)) {
+            mark(std::get<SharedPtr<Closure>>(callable));
+        }
+    }
+
+    void Collector::mark(Traced* object) {
+        if (!object) {
+            return;
+        }
+        if (phase == Phase::Counting) {
+            enterSubgraph(object);
+            object->internal++;
+            return;
+        }
+        if (phase == Phase::Rescuing) {
+            rescue(object);
+            return;
+        }
+        // a young collection takes everything old to be alive, and doesn't look inside it
+        if (!full && object->old) {
+            return;
+        }
+        if (markStack) {
+            if (!std::atomic_ref(object->marked).exchange(true)) {
+                markStack->push(object);
+            }
+            return;
+        }
+        if (object->marked) {
+            return;
+        }
+        object->marked = true;
+        pushGray(object);
+    }
+
+    void Collector::pushGray(Traced* object) {
+        gray.push_back(object);
+        object->grayIndex = uint32_t(gray.size() - 1);
+    }
+
+    Traced* Collector::popGray() {
+        auto object = gray.back();
+        gray.truncate(gray.size() - 1);
+        object->grayIndex = Traced::NOT_GRAY;
+        return object;
+    }
+
+    // a gray object freed between slices, the last one takes its place
+    void Collector::removeGray(Traced* object) {
+        auto last = popGray();
+        if (last != object) {
+            gray[object->grayIndex] = last;
+            last->grayIndex = std::exchange(object->grayIndex, Traced::NOT_GRAY);
+        }
+    }
+
+    // returns true once there is nothing gray left
+    bool Collector::traceGray(size_t budget) {
+        for (; budget > 0 && gray.size() > 0; --budget) {
+            popGray()->trace(*this);
+        }
+        return gray.size() == 0;
+    }
+
+    // The roots are dealt out to the threads, each traces from its own stack and steals from the
+    // others when it runs out. A thread with nothing to do counts itself idle, marking is over once
+    // all of them are, as only a thread with work can make more
+    void Collector::traceParallel() {
+        std::vector<MarkStack> stacks(threads);
+        for (size_t index = 0; index < gray.size(); ++index) {
+            gray[index]->grayIndex = Traced::NOT_GRAY;
+            stacks[index % threads].push(gray[index]);
+        }
+        gray.clear();
+
+        std::atomic<size_t> idle = 0;
+        auto steal = [&stacks](size_t self) {
+            for (size_t offset = 1; offset < stacks.size(); ++offset) {
+                if (stacks[self].stealFrom(stacks[(self + offset) % stacks.size()])) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        auto anyWork = [&stacks]() { return std::ranges::any_of(stacks, [](const MarkStack& stack) { return !stack.empty(); }); };
+        auto work = [this, &stacks, &idle, &steal, &anyWork](size_t self) {
+            markStack = &stacks[self];
+            while (true) {
+                if (auto object = stacks[self].pop()) {
+                    object->trace(*this);
+                    continue;
+                }
+                if (steal(self)) {
+                    continue;
+                }
+                idle++;
+                while (idle < stacks.size() && !anyWork()) {
+                    std::this_thread::yield();
+                }
+                if (idle == stacks.size()) {
+                    break;
+                }
+                idle--;
+            }
+            markStack = nullptr;
+        };
+
+        markWorkers.run(threads, work);
+    }
+
+    void Collector::clearRemembered() {
+        while (remembered) {
+            remembered->remembered = false;
+            remembered = std::exchange(remembered->nextRemembered, nullptr);
+        }
+    }
+
+    bool Collector::beginCollection() {
+        full = fullDemanded || arena.bytesAllocated() > nextCollection || (stress && collections % STRESS_FULL_EVERY == 0);
+        garbage = 0;
+        return full;
+    }
+
+    size_t Collector::collect() {
+        if (full && sliceBudget > 0 && !fullDemanded) {
+            phase = Phase::Marking;
+            Traced::marking = true;
+            return 0;
+        }
+        if (!full) {
+            for (auto object = remembered; object; object = object->nextRemembered) {
+                object->trace(*this);
+            }
+        }
+        if (full && threads > 1) {
+            traceParallel();
+        } else {
+            traceGray(SIZE_MAX);
+        }
+        gray.clear();  // gives the memory back
+        clearRemembered();
+
+        Graveyard graveyard;
+        startSweep();
+        sweep(SIZE_MAX, graveyard);
+        graveyard.clear();  // the cycles lose their last references here and free themselves
+        finishCollection();
+        compactBuffers();
+        return garbage;
+    }
+
+    bool Collector::step() {
+        nursery.resetAllocated();
+        if (phase == Phase::Marking) {
+            return traceGray(sliceBudget);
+        }
+        Graveyard graveyard;
+        bool swept = sweep(sliceBudget, graveyard);
+        graveyard.clear();
+        if (swept) {
+            finishCollection();
+            compactBuffers();
+        }
+        return false;
+    }
+
+    void Collector::finishMarking() {
+        traceGray(SIZE_MAX);
+        gray.clear();
+        Traced::marking = false;
+        clearRemembered();
+        startSweep();
+        phase = Phase::Sweeping;
+    }
+
+    void Collector::cancel() {
+        while (gray.size() > 0) {
+            popGray();
+        }
+        gray.clear();
+        for (auto list : {young, old}) {
+            for (auto object = list; object; object = object->next) {
+                object->marked = false;
+            }
+        }
+        Traced::marking = false;
+        sweepCursor = nullptr;
+        phase = Phase::Idle;
+    }
+
+    void Collector::addRoots(void* context, RootMarker marker) {
+        assert(onOwnerThread());
+        owner = std::this_thread::get_id();
+        rootSources.push_back(RootSource{context, marker});
+    }
+
+    void Collector::removeRoots(void* context) {
+        for (size_t i = 0; i < rootSources.size(); ++i) {
+            if (rootSources[i].context == context) {
+                rootSources.eraseAt(i);
+                break;
+            }
+        }
+        if (rootSources.size() == 0) {
+            cancel();
+            owner = {};
+        }
+    }
+
+    void Collector::markRoots(bool full) {
+        for (const auto& source : rootSources) {
+            source.marker(source.context, full);
+        }
+    }
+
+    // the old generation goes first, so the young survivors promoted into it aren't swept twice
+    void Collector::startSweep() {
+        sweepingOld = full;
+        sweepCursor = full ? old : young;
+    }
+
+    // sweeps up to budget objects from where it last stopped, promoting the young survivors on the
+    // way through. Returns true once everything has been swept
+    bool Collector::sweep(size_t budget, Graveyard& graveyard) {
+        for (; budget > 0; --budget) {
+            if (!sweepCursor) {
+                if (!sweepingOld) {
+                    return true;
+                }
+                sweepingOld = false;
+                sweepCursor = young;
+                continue;
+            }
+            auto object = std::exchange(sweepCursor, sweepCursor->next);
+            if (!object->marked) {
+                object->expireWeakRef();
+                object->clearReferences(graveyard);
+                garbage++;
+            } else {
+                object->marked = false;
+                if (!object->old) {
+                    unlink(young, object);
+                    object->old = true;
+                    link(old, object);
+                }
+            }
+        }
+        return false;
+    }
+
+    void Collector::finishCollection() {
+        nursery.resetAllocated();
+        fullDemanded = false;
+        if (full) {
+            nextCollection = std::max(FIRST_COLLECTION, arena.bytesAllocated() * GROWTH_FACTOR);
+        }
+        phase = Phase::Idle;
+        collections++;
+    }
+
+    // only once the garbage has been freed, as that is what leaves the holes to fill. Every object
+    // is old after a full collection
+    void Collector::compactBuffers() {
+        if (!full || compactBuffersAbove == 0 || arena.fragmentation() <= compactBuffersAbove) {
+            return;
+        }
+        for (auto object = old; object; object = object->next) {
+            object->compactBuffers();
+        }
+    }
+
+    void Collector::buffer(Traced* object) {
+        candidates.push_back(object);
+        object->candidateIndex = uint32_t(candidates.size() - 1);
+    }
+
+    // the subgraph's objects are marked while it is being found
+    void Collector::enterSubgraph(Traced* object) {
+        if (!object->marked) {
+            object->marked = true;
+            object->internal = 0;
+            subgraph.push_back(object);
+            pushGray(object);
+        }
+    }
+
+    // and unmarked again once they turn out to be alive
+    void Collector::rescue(Traced* object) {
+        if (object->marked) {
+            object->marked = false;
+            pushGray(object);
+        }
+    }
+
+    size_t Collector::collectCycles() {
+        phase = Phase::Counting;
+        for (auto candidate : candidates) {
+            enterSubgraph(candidate);
+        }
+        traceGray(SIZE_MAX);
+
+        phase = Phase::Rescuing;
+        for (auto object : subgraph) {
+            // an object not owned by a SharedPtr can't be counted, so it is taken to be alive
+            if (!object->references || *object->references > object->internal) {
+                rescue(object);
+            }
+        }
+        traceGray(SIZE_MAX);
+        gray.clear();
+
+        // the candidates go first, as letting go of the garbage buffers the objects it pointed at
+        for (auto candidate : candidates) {
+            candidate->candidateIndex = Traced::NOT_BUFFERED;
+        }
+        candidates.clear();
+        phase = Phase::Idle;
+
+        Graveyard graveyard;
+        size_t garbage = 0;
+        for (auto object : subgraph) {
+            if (object->marked) {
+                object->marked = false;
+                object->expireWeakRef();
+                object->clearReferences(graveyard);
+                garbage++;
+            }
+        }
+        subgraph.clear();
+        graveyard.clear();
+        collections++;
+        return garbage;
+    }
+}
@@ -0,0 +1,188 @@
+#ifndef CPPLOX_COLLECTOR_H_
+#define CPPLOX_COLLECTOR_H_
+
+#include <thread>
+#include <vector>
+
+#include "gc.h"
+#include "memory.h"
+#include "value.h"
+#include "vector.h"
+
+// A backup tracing collector for the cycles reference counting can't free. It only runs at a
+// safepoint between instructions, where every live object is reachable from the VM's roots, and it
+// never frees anything itself: garbage has its references moved out and the counts do the rest.
+// It is generational: most collections only look at objects made since the last one, with old
+// objects written to since then standing in as extra roots. Objects can't be moved, as upvalues
+// and control blocks point straight at them, so surviving a collection promotes an object in place.
+// With a slice budget set, full collections are incremental: marking and sweeping are done a few
+// objects at a time between instructions, and write barriers keep a traced object from pointing
+// at one that hasn't been marked. Young collections stay in one go, the nursery bounds their work.
+// A full collection done in one go can be marked by several threads, the program is stopped then.
+// After a full collection the buffers objects own, like their tables, can be slid down the arena
+// to fill the holes that freeing left. Only buffers: the objects and their control blocks stay
+// where they are, so the holes between those are left as they are.
+// Nothing here is locked: traced objects are made, written and freed on the thread the VMs run on,
+// which is checked as they are tracked and untracked. Otherwise only the marking threads read them
+namespace lox {
+    // holds the references taken out of garbage, so nothing is freed while the heap is being walked
+    class Graveyard {
+    public:
+        void bury(Value value);
+        void bury(Callable callable);
+        void clear();
+
+    private:
+        Vector<Value> values;
+    };
+
+    class Collector {
+    public:
+        void track(Traced* object);
+        void untrack(Traced* object);
+        void written(Traced* object);
+
+        void mark(const Value& value);
+        void mark(const Callable& callable);
+        void mark(Traced* object);
+        template <typename T>
+        void mark(const SharedPtr<T>& object) {
+            if (gathering) {
+                gathering->push_back(Value{object});
+                return;
+            }
+            mark(static_cast<Traced*>(*object));
+        }
+        // the write barrier for roots that are kept until the end of marking, like the globals
+        void shade(const Value& value) {
+            if (Traced::marking) {
+                mark(value);
+            }
+        }
+
+        bool shouldCollect() const {
+            if (Traced::trialDeletion) {
+                return stress || candidates.size() > CANDIDATES_PER_COLLECTION;
+            }
+            if (phase != Phase::Idle) {
+                return stress || nursery.bytesAllocated() > sliceBudget * SLICE_BYTES_PER_OBJECT;
+            }
+            return stress || nursery.bytesAllocated() > YOUNG_COLLECTION || arena.bytesAllocated() > nextCollection;
+        }
+        // an incremental collection has started and not finished yet
+        bool collecting() const {
+            return phase != Phase::Idle;
+        }
+        // picks between a young and a full collection, returns true for full. Call before marking the roots
+        bool beginCollection();
+        // has the next collection be a full one done in one go, for when memory has run short
+        void demandFull() {
+            fullDemanded = true;
+        }
+        // the roots should already be marked, returns how many objects were found to be garbage. An
+        // incremental collection only starts here and is carried on by step
+        size_t collect();
+        // does a slice of an incremental collection. Returns true when marking has run out of work,
+        // then the roots without a write barrier have to be marked again before finishMarking
+        bool step();
+        void finishMarking();
+        // drops an unfinished collection, for when the roots are going away
+        void cancel();
+
+        // the tracked objects are shared by every VM, so a collection marks the roots of all of them,
+        // not just of the one it runs from. full says whether it is a full collection
+        using RootMarker = void (*)(void* context, bool full);
+        void addRoots(void* context, RootMarker marker);
+        // once the last VM is gone an unfinished collection is dropped
+        void removeRoots(void* context);
+        void markRoots(bool full);
+        // the thread the VMs run on, once there is one
+        bool onOwnerThread() const {
+            return owner == std::thread::id{} || owner == std::this_thread::get_id();
+        }
+
+        // Trial deletion finds the cycles among the objects that had a reference dropped since the
+        // last time, and everything they reach. It doesn't need the roots: what is left of an
+        // object's count once the references from inside that subgraph are taken off must be from
+        // outside it, so the object is alive, and so is everything it reaches
+        void useTrialDeletion() {
+            Traced::trialDeletion = true;
+        }
+        bool usesTrialDeletion() const {
+            return Traced::trialDeletion;
+        }
+        void buffer(Traced* object);
+        // returns how many objects were found to be garbage
+        size_t collectCycles();
+
+        // while a list is set, marking only adds what it is given to it. A heap dump traces each
+        // object this way to find what it refers to, without disturbing a collection in progress
+        void gatherInto(std::vector<Value>* list) {
+            gathering = list;
+        }
+
+        bool stress = false;      // collect at every safepoint
+        size_t sliceBudget = 0;  // objects marked or swept in each slice, 0 does a collection in one go
+        size_t threads = 1;      // that mark a full collection done in one go
+        double compactBuffersAbove = 0;  // the arena fragmentation that has a full collection compact buffers, 0 never does
+
+    private:
+        static constexpr size_t FIRST_COLLECTION = 1024 * 1024;
+        static constexpr size_t GROWTH_FACTOR = 2;
+        static constexpr size_t YOUNG_COLLECTION = 256 * 1024;  // bytes of new objects between young collections
+        static constexpr size_t STRESS_FULL_EVERY = 8;
+        static constexpr size_t CANDIDATES_PER_COLLECTION = 10000;
+        // a slice is due after this many bytes per object in the budget, more than the smallest
+        // object, so marking gets through more than the program makes in the meantime
+        static constexpr size_t SLICE_BYTES_PER_OBJECT = 16;
+
+        struct RootSource {
+            void* context;
+            RootMarker marker;
+        };
+
+        enum class Phase {
+            Idle,
+            Marking,
+            Sweeping,
+            Counting,  // the two walks of a trial deletion
+            Rescuing
+        };
+
+        void pushGray(Traced* object);
+        Traced* popGray();
+        void removeGray(Traced* object);
+        void enterSubgraph(Traced* object);
+        void rescue(Traced* object);
+        bool traceGray(size_t budget);
+        void traceParallel();
+        void clearRemembered();
+        void startSweep();
+        bool sweep(size_t budget, Graveyard& graveyard);
+        void finishCollection();
+        void compactBuffers();
+        static void link(Traced*& list, Traced* object);
+        static void unlink(Traced*& list, Traced* object);
+
+        Traced* young = nullptr;
+        Traced* old = nullptr;
+        Traced* remembered = nullptr;  // old objects written to since the last collection
+        Vector<Traced*> gray;
+        Vector<Traced*> candidates;  // for trial deletion
+        Vector<Traced*> subgraph;
+        Phase phase = Phase::Idle;
+        bool full = false;
+        bool fullDemanded = false;
+        Traced* sweepCursor = nullptr;
+        bool sweepingOld = false;
+        size_t garbage = 0;
+        size_t collections = 0;
+        size_t nextCollection = FIRST_COLLECTION;
+        std::vector<Value>* gathering = nullptr;
+        Vector<RootSource> rootSources;
+        std::thread::id owner;
+    };
+
+    extern Collector collector;
+}
+#endif
@@ -1,6 +1,17 @@
 #ifndef CPPLOX_COMMON_H_
 #define CPPLOX_COMMON_H_
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+
+namespace lox {
+    // a VM and everything it makes belong to one thread, so counting references needs no atomics
+    // unless objects are going to be shared between threads
+#ifdef LOX_ATOMIC_REFCOUNT
+    using RefCount = std::atomic<size_t>;
+#else
+    using RefCount = size_t;
+#endif
+}
 #endif
\ No newline at end of file
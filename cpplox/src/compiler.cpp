@@ -1,5 +1,6 @@
 #include "compiler.h"
 
+#include <bit>
 #include <print>
 
 #include "algorithm.h"
@@ -46,6 +47,14 @@ namespace lox {
 
         function->getChunk()->write(OpCode::Pop, parser->getPreviousToken().line);  // for once tracker
         emitReturn();
+        for (size_t index = 0; index < locals.size(); ++index) {
+            finishLocalFunction(locals[index]);
+        }
+        if (functionType == FunctionType::METHOD) {
+            if (auto field = fieldGetter(**function); field.hasValue()) {
+                function->setFieldGetter(field.value());
+            }
+        }
         if (debugMode && !parser->hasError()) {
             std::println("{}\n{}", function->getName(), **(function->getChunk()));
         }
@@ -117,9 +126,239 @@ namespace lox {
     }
 
     void Compiler::call(bool) {
+        auto candidate = inlineCandidateForCallee();
         uint8_t argCount = argumentList();
+        if (candidate.hasValue() && candidate.value().function->getArity() == argCount && emitInlineCall(candidate.value(), argCount)) {
+            return;
+        }
+        emit(OpCode::Call);
+        emit(argCount);
+    }
+
+    namespace {
+        const size_t MAX_INLINE_SIZE = 64;
+        const size_t MAX_INLINE_ARITY = 8;
+    }
+
+    // An inlineable function is a tiny straight line expression, like `fun sq(x) { return x * x; }`
+    // It can't call (so it can't recurse), capture or jump, which means its body can be copied into
+    // the caller with its parameters read off the caller's stack instead of out of a new frame
+    Optional<Vector<Compiler::InlineOp>> Compiler::inlineBody(const Function& function) {
+        const Chunk& chunk = **function.getChunk();
+        size_t arity = function.getArity();
+        if (function.getUpValueCount() > 0 || arity > MAX_INLINE_ARITY || chunk.size() > MAX_INLINE_SIZE) {
+            return {};
+        }
+        auto it = chunk.begin();
+        if (!std::holds_alternative<Constant>(it->instruction())) {
+            return {};
+        }
+        ++it;  // skip the once tracker, nothing in an inlineable body can use it
+
+        Vector<InlineOp> body;
+        size_t height = 0;  // how many values the body has pushed above its arguments
+        bool returned = false;
+        size_t line = 0;  // of the instruction being looked at
+        auto push = [&body, &height, &line](OpCode opcode, size_t operand = 0) {
+            body.push_back({opcode, operand, line});
+            height++;
+            return true;
+        };
+        auto combine = [&body, &height, &line](OpCode opcode) {
+            if (height < 2) {
+                return false;
+            }
+            body.push_back({opcode, 0, line});
+            height--;
+            return true;
+        };
+        auto unary = [&body, &height, &line](OpCode opcode) {
+            body.push_back({opcode, 0, line});
+            return height > 0;
+        };
+        for (; it != chunk.end() && !returned; ++it) {
+            line = chunk.getLineNumber(it->offset());
+            bool inlineable = std::visit(
+                overload{
+                    [&push, &height, arity](const GetLocal& g) {
+                        if (g.value() == 0 || g.value() > arity) {
+                            return false;
+                        }
+                        return push(OpCode::Peek, arity - g.value() + height);
+                    },
+                    [&push](const Constant& c) { return push(OpCode::Constant, c.value()); },
+                    [&push](const GetGlobal& g) { return push(OpCode::GetGlobal, g.value()); },
+                    [&body, &height, &line](const GetProperty& g) {
+                        body.push_back({OpCode::GetProperty, g.value(), line});
+                        return height > 0;
+                    },
+                    [&combine](const Binary& b) { return combine(b.opcode); },
+                    [&combine](const BinaryPredicate& b) { return combine(b.opcode); },
+                    [&combine](const Equal&) { return combine(OpCode::Equal); },
+                    [&unary](const Negate&) { return unary(OpCode::Negate); },
+                    [&unary](const Not&) { return unary(OpCode::Not); },
+                    [&push](const Nil&) { return push(OpCode::Nil); },
+                    [&push](const True&) { return push(OpCode::True); },
+                    [&push](const False&) { return push(OpCode::False); },
+                    [&returned, &height](const Return&) {
+                        returned = true;
+                        return height == 1;
+                    },
+                    [](const auto&) { return false; }},
+                it->instruction());
+            if (!inlineable) {
+                return {};
+            }
+        }
+        if (!returned) {
+            return {};
+        }
+        return body;
+    }
+
+    // a method that is nothing but `return this.<field>;`
+    Optional<InternedString> Compiler::fieldGetter(const Function& function) {
+        const Chunk& chunk = **function.getChunk();
+        if (function.getArity() != 0) {
+            return {};
+        }
+        auto it = chunk.begin();
+        if (!std::holds_alternative<Constant>(it->instruction())) {
+            return {};
+        }
+        ++it;
+        auto self = it->instruction();
+        if (!std::holds_alternative<GetLocal>(self) || std::get<GetLocal>(self).value() != 0) {
+            return {};
+        }
+        ++it;
+        auto property = it->instruction();
+        if (!std::holds_alternative<GetProperty>(property)) {
+            return {};
+        }
+        ++it;
+        if (!std::holds_alternative<Return>(it->instruction())) {
+            return {};
+        }
+        return as<InternedString>(chunk.getConstant(std::get<GetProperty>(property).value()));
+    }
+
+    Optional<Compiler::InlineCandidate> Compiler::inlineCandidateForCallee() {
+        if (!lastGlobalRead.hasValue() || lastGlobalRead.value().end != getCurrentChunk()->size()) {
+            return {};
+        }
+        Compiler* script = this;
+        while (script->enclosing) {
+            script = script->enclosing;
+        }
+        return script->inlineCandidates.get(lastGlobalRead.value().name);
+    }
+
+    // The callee's body goes in behind a guard that checks the global still holds the function we inlined.
+    // If it has been reassigned since, the guard jumps over the body to a regular call. The inlined
+    // instructions take one byte constants, when the pool is past that the call is left as it is.
+    // They keep the callee's lines, and the chunk notes where the body is so errors in it name the callee
+    bool Compiler::emitInlineCall(const InlineCandidate& candidate, uint8_t argCount) {
+        const Chunk& callee = **candidate.function->getChunk();
+        size_t callLine = previousLine();
+        // a call left as it is mustn't keep constants only the inlined body would have used
+        size_t constantCount = getCurrentChunk()->getConstantCount();
+        auto function = inlineConstant(Value{candidate.function});
+        if (!function) {
+            return false;
+        }
+        SmallVector<uint8_t, 8> operands;
+        for (const auto& op : candidate.body) {
+            if (op.opcode == OpCode::Constant || op.opcode == OpCode::GetGlobal || op.opcode == OpCode::GetProperty) {
+                auto index = inlineConstant(callee.getConstant(op.operand));
+                if (!index) {
+                    getCurrentChunk()->truncateConstants(constantCount);
+                    return false;
+                }
+                operands.push_back(index.value());
+            }
+        }
+
+        auto guard = emitJump(OpCode::InlineGuard);
+        emit(argCount);
+        emit(function.value());
+        auto chunk = getCurrentChunk();
+        size_t bodyStart = chunk->size();
+        size_t constant = 0;
+        for (const auto& op : candidate.body) {
+            chunk->write(op.opcode, op.line);
+            switch (op.opcode) {
+            case OpCode::Peek:
+                chunk->write(op.operand, op.line);
+                break;
+            case OpCode::Constant:
+            case OpCode::GetGlobal:
+            case OpCode::GetProperty:
+                chunk->write(size_t(operands[constant++]), op.line);
+                break;
+            default:
+                break;
+            }
+        }
+        chunk->addInlined({bodyStart, chunk->size(), function.value(), callLine});
+        emit(OpCode::InlineReturn);
+        emit(size_t(argCount) + 1);
+        auto end = emitJump(OpCode::Jump);
+
+        patchJump(guard);
         emit(OpCode::Call);
         emit(argCount);
+        patchJump(end);
+        return true;
+    }
+
+    // the same constant, with 0 and -0 told apart as the pool has to keep both
+    static bool sameConstant(const Value& a, const Value& b) {
+        if (isNumber(a) && isNumber(b)) {
+            return std::bit_cast<uint64_t>(as<double>(a)) == std::bit_cast<uint64_t>(as<double>(b));
+        }
+        return a == b;
+    }
+
+    size_t Compiler::InlinedConstant::getHash() const {
+        if (isNumber(value)) {
+            auto bits = std::bit_cast<uint64_t>(as<double>(value));
+            return bits ^ (bits >> 32);
+        }
+        if (is<InternedString>(value)) {
+            return as<InternedString>(value).getHash();
+        }
+        if (is<SharedPtr<Function>>(value)) {
+            auto bits = reinterpret_cast<uintptr_t>(*as<SharedPtr<Function>>(value));
+            return (bits >> 4) ^ (bits >> 20);
+        }
+        return 0;
+    }
+
+    bool Compiler::InlinedConstant::operator==(const InlinedConstant& other) const {
+        return sameConstant(value, other.value);
+    }
+
+    // Each inlined call needs the same few constants, so one pool entry serves them all. Names may
+    // already be in the pool as identifiers. An index is only trusted while the pool still holds the
+    // value there, a call that wasn't inlined after all takes its constants back off the end
+    Optional<uint8_t> Compiler::inlineConstant(const Value& value) {
+        auto chunk = getCurrentChunk();
+        size_t count = chunk->getConstantCount();
+        auto known = is<InternedString>(value) ? constants.get(as<InternedString>(value)) : Optional<size_t>{};
+        if (!known.hasValue()) {
+            known = inlinedConstants.get(InlinedConstant{value});
+        }
+        if (known.hasValue() && known.value() < count && known.value() <= std::numeric_limits<uint8_t>::max() &&
+            sameConstant(chunk->getConstant(known.value()), value)) {
+            return uint8_t(known.value());
+        }
+        if (count > std::numeric_limits<uint8_t>::max()) {
+            return {};
+        }
+        auto index = chunk->addConstant(value);
+        inlinedConstants.insert(InlinedConstant{value}, index);
+        return uint8_t(index);
     }
 
     uint8_t Compiler::argumentList() {
@@ -375,6 +614,7 @@ namespace lox {
         while (locals.size() > 0 && locals.back().depth && locals.back().depth.value() > depth) {
             auto opcode = (locals.back().isCaptured) ? OpCode::CloseUpValue : OpCode::Pop;
             emit(opcode);
+            finishLocalFunction(locals.back());
             locals.pop_back();
         }
     }
@@ -516,7 +756,7 @@ namespace lox {
         auto index = addLocal(ReservedInternal::SwitchCondition, true);
         getCurrentChunk()->writeOpAndIndex(OpCode::SetLocal, OpCode::SetLocal, index, parser->getPreviousToken().line);
         lox::Optional<size_t> lastJump;
-        lox::Vector<size_t> endOfCaseJumps;
+        lox::SmallVector<size_t, 8> endOfCaseJumps;
         while (parser->match(TokenType::Case) || parser->match(TokenType::Default)) {
             if (lastJump.hasValue()) {
                 emit(OpCode::Pop);
@@ -677,7 +917,9 @@ namespace lox {
         OpCode getop = OpCode::GetGlobal;
         OpCode getLongOp = OpCode::LongGetGlobal;
         auto index = resolveLocal(name);
+        Local* local = nullptr;
         if (index.hasValue()) {
+            local = &locals[index.value()];
             setop = setLongOp = OpCode::SetLocal;
             getop = getLongOp = OpCode::GetLocal;
             isConstant = locals[index.value()].constant;
@@ -693,10 +935,19 @@ namespace lox {
                 parser->errorAtPrevious("Can't re-assign constant");
                 return;
             }
+            if (local) {
+                local->escapes = true;
+            }
             expression();
             getCurrentChunk()->writeOpAndIndex(setop, setLongOp, index.value(), parser->getPreviousToken().line);
         } else {
+            if (local && !parser->check(TokenType::LeftParen)) {
+                local->escapes = true;  // anything but calling it directly could keep it past this frame
+            }
             getCurrentChunk()->writeOpAndIndex(getop, getLongOp, index.value(), parser->getPreviousToken().line);
+            if (getop == OpCode::GetGlobal) {
+                lastGlobalRead = GlobalRead{InternedString(manglePrivate(name)), getCurrentChunk()->size()};
+            }
         }
     }
 
@@ -719,6 +970,7 @@ namespace lox {
             auto local = enclosing->resolveLocal(name);
             if (local.hasValue()) {
                 enclosing->locals[local.value()].isCaptured = true;
+                enclosing->locals[local.value()].escapes = true;
                 return addUpvalue(local.value(), true);
             }
 
@@ -733,7 +985,7 @@ namespace lox {
     size_t Compiler::addUpvalue(size_t index, bool isLocal) {
         auto upvalueIndex = function->getUpvalue(index, isLocal);
         if (upvalueIndex.hasValue()) {
-            return index;
+            return upvalueIndex.value();
         }
         return function->addUpvalue(index, isLocal);
     }
@@ -816,12 +1068,26 @@ namespace lox {
 
     void Compiler::funDeclaration() {
         size_t global = parseVariable("Expect function name. ", false);
+        auto name = parser->getPreviousToken().token;
         markInitialized();
-        func(FunctionType::FUNCTION);
+        size_t closureOffset = getCurrentChunk()->size();
+        auto function = func(FunctionType::FUNCTION);
+        if (function && depth > 0 && function->getUpValueCount() > 0) {
+            locals.back().function = function;
+            locals.back().closureOffset = closureOffset;
+        }
         defineVariable(global);
+        if (function && depth == 0 && !enclosing) {
+            auto body = inlineBody(**function);
+            if (body.hasValue()) {
+                inlineCandidates.insert(InternedString(manglePrivate(name)), InlineCandidate{function, body.value()});
+            } else {
+                inlineCandidates.erase(InternedString(manglePrivate(name)));
+            }
+        }
     }
 
-    void Compiler::func(FunctionType type) {
+    SharedPtr<Function> Compiler::func(FunctionType type) {
         Compiler compiler(this, type);
         compiler.debugMode = debugMode;
         compiler.beginCompile();
@@ -841,7 +1107,7 @@ namespace lox {
 
         auto function = compiler.endCompile();
         if (!function) {
-            return;
+            return nullptr;
         }
         if (function->getUpValueCount()) {
             emit(OpCode::Closure);
@@ -858,6 +1124,56 @@ namespace lox {
             emit(upvalue.isLocal ? 1 : 0);
             emit(upvalue.index);
         }
+        return function;
+    }
+
+    // only a function whose captures all live directly in the declaring frame, and that makes
+    // no closures of its own, can read them from that frame instead of through upvalues
+    bool Compiler::canReadFrame(const Function& function) {
+        for (auto& upvalue : function.getUpvalues()) {
+            if (!upvalue.isLocal || upvalue.index > UINT8_MAX) {
+                return false;
+            }
+        }
+        const Chunk& chunk = **function.getChunk();
+        for (auto it = chunk.begin(); it != chunk.end(); ++it) {
+            if (std::holds_alternative<ClosureOp>(it->instruction())) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // a local function that is only ever called by name from the frame that declared it can't outlive
+    // that frame, so skip making a closure and let it use the frame's slots for its upvalues
+    void Compiler::finishLocalFunction(Local& local) {
+        if (!local.function) {
+            return;
+        }
+        auto callee = local.function;
+        local.function = SharedPtr<Function>{};
+        if (local.escapes || !canReadFrame(**callee)) {
+            return;
+        }
+
+        auto chunk = callee->getChunk();
+        auto& upvalues = callee->getUpvalues();
+        for (auto it = chunk->begin(); it != chunk->end(); ++it) {
+            size_t offset = it->offset();
+            std::visit(overload{
+                           [&chunk, &upvalues, offset](const GetUpValue& g) {
+                               chunk->writeAt(offset, std::byte{std::to_underlying(OpCode::GetOuterLocal)});
+                               chunk->writeAt(offset + 1, std::byte(upvalues[g.value()].index));
+                           },
+                           [&chunk, &upvalues, offset](const SetUpValue& s) {
+                               chunk->writeAt(offset, std::byte{std::to_underlying(OpCode::SetOuterLocal)});
+                               chunk->writeAt(offset + 1, std::byte(upvalues[s.value()].index));
+                           },
+                           [](const auto&) {},
+                       },
+                       it->instruction());
+        }
+        getCurrentChunk()->writeAt(local.closureOffset, std::byte{std::to_underlying(OpCode::LocalFunction)});
     }
 
     size_t Compiler::parseVariable(StringView errorMessage, bool constant) {
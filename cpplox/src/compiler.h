@@ -101,7 +101,7 @@ namespace lox {
         void funDeclaration();
         void variable(bool);
         void classDeclaration();
-        void func(FunctionType ft);
+        SharedPtr<Function> func(FunctionType ft);
         size_t previousLine() const;
         void parsePrecedence(Precedence precedence);
         const ParseRule& getRule(TokenType type) const;
@@ -118,9 +118,33 @@ namespace lox {
         void beginCompile();
         SharedPtr<Function> endCompile();
         String manglePrivate(StringView name);
+
+        // a step of an inlined body, operand is the stack depth for Peek, or a constant of the callee
+        struct InlineOp {
+            OpCode opcode = OpCode::Unknown;
+            size_t operand = 0;
+            size_t line = 0;  // in the callee, so an error in the inlined copy is reported there
+        };
+        struct InlineCandidate {
+            SharedPtr<Function> function;
+            Vector<InlineOp> body;
+        };
+        static Optional<Vector<InlineOp>> inlineBody(const Function& function);
+        static Optional<InternedString> fieldGetter(const Function& function);
+        Optional<InlineCandidate> inlineCandidateForCallee();
+        bool emitInlineCall(const InlineCandidate& candidate, uint8_t argCount);
+        Optional<uint8_t> inlineConstant(const Value& value);
+
         Scanner scanner;
         SharedPtr<Parser> parser;
         Table<InternedString, size_t> constants;
+        // where inlined calls put their constants in the pool, so each one is only looked up once
+        struct InlinedConstant {
+            Value value;
+            size_t getHash() const;
+            bool operator==(const InlinedConstant& other) const;
+        };
+        Table<InlinedConstant, size_t> inlinedConstants;
         HashSet<String> immutables;
 
         struct Local {
@@ -128,7 +152,13 @@ namespace lox {
             Optional<size_t> depth;  // will not have a value if its uninitialized
             bool constant;
             bool isCaptured = false;
+            // set for a local function with upvalues, until it either escapes or goes out of scope
+            SharedPtr<Function> function = {};
+            size_t closureOffset = 0;  // where its Closure op is in this chunk
+            bool escapes = false;
         };
+        static bool canReadFrame(const Function& function);
+        void finishLocalFunction(Local& local);
         StaticVector<Local, 1024> locals;
         size_t localCount = 0;
         size_t depth = 0;
@@ -143,12 +173,20 @@ namespace lox {
         struct Loop {
             size_t depth = 0;
             size_t startLocation = 0;
-            Vector<size_t> breakLocations = {};
+            SmallVector<size_t, 4> breakLocations = {};
         };
         Vector<Loop> nestedLoops;
 
         ClassCompiler* classCompiler = nullptr;
         StringView currentClass = "";
+
+        // only filled in on the script compiler, global functions that calls can be inlined to
+        Table<InternedString, InlineCandidate> inlineCandidates;
+        struct GlobalRead {
+            InternedString name;
+            size_t end = 0;  // the chunk size right after the read, to check it is the callee
+        };
+        Optional<GlobalRead> lastGlobalRead;
     };
 }
 #endif
\ No newline at end of file
@@ -31,7 +31,8 @@ namespace lox {
         out << std::format("{:<32}({} {})", i.name, i.value(), i.value() + offset);
     }
 
-    void withClosure(std::ostringstream& out, const Chunk& chunk, const ClosureOp& closure) {
+    template <typename I>
+    void withClosure(std::ostringstream& out, const Chunk& chunk, const I& closure) {
         withConstant(out, chunk, closure);
         for (auto upvalue : closure.getUpValues()) {
             out << std::format("\n        |             {} {} ", (upvalue.isLocal ? "local" : "upvalue"), upvalue.index);
@@ -56,6 +57,7 @@ namespace lox {
             [&out, &chunk, &instruction](Call& o) { withConstant(out, chunk, o); },
             [&out, &chunk, &instruction](ClassOp& o) { withConstant(out, chunk, o); },
             [&out, &chunk, &instruction](ClosureOp& o) { withClosure(out, chunk, o); },
+            [&out, &chunk, &instruction](LocalFunctionOp& o) { withClosure(out, chunk, o); },
             [&out, &chunk, &instruction](Constant& o) { withConstant(out, chunk, o); },
             [&out, &chunk, &instruction](LongConstant& o) { withConstant(out, chunk, o); },
             [&out, &chunk, &instruction](DefineGlobal& o) { withConstant(out, chunk, o); },
@@ -75,9 +77,17 @@ namespace lox {
             [&out, &chunk, &instruction](SetProperty& o) { withRawValue(out, o); },
             [&out, &chunk, &instruction](GetUpValue& o) { withRawValue(out, o); },
             [&out, &chunk, &instruction](SetUpValue& o) { withRawValue(out, o); },
+            [&out, &chunk, &instruction](GetOuterLocal& o) { withRawValue(out, o); },
+            [&out, &chunk, &instruction](SetOuterLocal& o) { withRawValue(out, o); },
             [&out, &chunk, &instruction](JumpIfFalse& o) { withJump(out, o, instruction.offset()); },
             [&out, &chunk, &instruction](Jump& o) { withJump(out, o, instruction.offset()); },
             [&out, &chunk, &instruction](Loop& o) { withJump(out, o, -1 * instruction.offset()); },
+            [&out, &chunk, &instruction](InlineGuard& o) {
+                withJump(out, o, instruction.offset());
+                out << std::format(" {} ({} args)", chunk.getConstant(o.getConstant()), o.getArgumentCount());
+            },
+            [&out, &chunk, &instruction](InlineReturn& o) { withRawValue(out, o); },
+            [&out, &chunk, &instruction](Peek& o) { withRawValue(out, o); },
             // simple instructions that are just a name
             [&out](auto i) { out << i.name; },
         };
@@ -27,7 +27,11 @@ namespace lox {
             throw lox::Exception("Could not read enough of the file", nullptr);
         }
 
+        // the scanner stops at the terminator, which has to be written as the block may have been used before
+        buffer[filesize] = '\0';
         read = true;
-        return String(buffer, filesize + 1);
+        String contents(buffer, filesize + 1);
+        std::ignore = reallocate(buffer, filesize + 1, 0);
+        return contents;
     }
 }
\ No newline at end of file
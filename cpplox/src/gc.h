@@ -0,0 +1,78 @@
+#ifndef CPPLOX_GC_H_
+#define CPPLOX_GC_H_
+
+#include <cstdint>
+
+#include "common.h"
+
+namespace lox {
+    class Collector;
+    class Graveyard;
+
+    // Anything that can end up in a reference cycle. Reference counting frees everything else, these
+    // register themselves so the collector can find the ones that nothing reachable points to any more
+    class Traced {
+    public:
+        Traced();
+        Traced(const Traced&);
+        Traced& operator=(const Traced&);
+        virtual ~Traced();
+
+        // marks everything this object refers to
+        virtual void trace(Collector& collector) const = 0;
+        // moves every reference out, so a garbage cycle falls apart once the graveyard is emptied
+        virtual void clearReferences(Graveyard& graveyard) = 0;
+        // moves the buffers the object owns lower down in the arena, the object itself stays put
+        virtual void compactBuffers() {}
+
+        // the write barrier, call it after storing a reference in this object. An old object that
+        // changed might point at young ones now, so a young collection has to look inside it, and one
+        // already traced by an incremental collection has to be traced again
+        void written() {
+            if ((old && !remembered) || (marking && marked)) {
+                barrier();
+            }
+        }
+
+        // called when a reference to this is dropped and others are left, the ones left might all
+        // be from a cycle that is garbage now
+        void released() {
+            if (trialDeletion && candidateIndex == NOT_BUFFERED) {
+                buffer();
+            }
+        }
+
+        // called once the object is known to be going, a weak reference can't hand it out after
+        void expireWeakRef() {
+            if (weaklyHeld) {
+                forgetWeakRef();
+            }
+        }
+
+    private:
+        friend class Collector;
+        friend class WeakRef;
+        template <typename T>
+        friend class SharedPtr;
+        static constexpr uint32_t NOT_GRAY = UINT32_MAX;
+        static constexpr uint32_t NOT_BUFFERED = UINT32_MAX;
+        static inline bool marking = false;  // an incremental collection is between slices of marking
+        static inline bool trialDeletion = false;  // cycles are found from candidates instead of roots
+        void barrier();
+        void buffer();
+        void forgetWeakRef();
+
+        Traced* previous = nullptr;
+        Traced* next = nullptr;
+        Traced* nextRemembered = nullptr;
+        const RefCount* references = nullptr;  // the count in the control block that owns this
+        uint32_t grayIndex = NOT_GRAY;  // where it is in the collector's gray stack
+        uint32_t candidateIndex = NOT_BUFFERED;
+        uint32_t internal = 0;  // references from objects in the subgraph a trial deletion looks at
+        bool marked = false;
+        bool old = false;  // survived a collection
+        bool remembered = false;
+        bool weaklyHeld = false;  // there is a WeakRef to it, which is kept apart so other objects don't pay for it
+    };
+}
+#endif
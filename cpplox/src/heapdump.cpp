@@ -0,0 +1,196 @@
+#include "heapdump.h"
+
+#include <fstream>
+
+#include "chunk.h"
+#include "collector.h"
+#include "loxexception.h"
+
+namespace lox {
+    using heapformat::Kind;
+
+    // long strings are cut down to this for their node's name
+    constexpr size_t STRING_NAME_LENGTH = 40;
+
+    // what tells two nodes apart, null for a value that isn't on the heap
+    static const void* identity(const Value& value) {
+        if (isString(value)) {
+            return as<InternedString>(value).begin();
+        }
+        if (is<SharedPtr<Function>>(value)) {
+            return borrow<Function>(value);
+        }
+        if (is<SharedPtr<NativeFunction>>(value)) {
+            return borrow<NativeFunction>(value);
+        }
+        if (is<SharedPtr<Closure>>(value)) {
+            return borrow<Closure>(value);
+        }
+        if (is<SharedPtr<UpValueObj>>(value)) {
+            return borrow<UpValueObj>(value);
+        }
+        if (is<SharedPtr<Class>>(value)) {
+            return borrow<Class>(value);
+        }
+        if (is<SharedPtr<Instance>>(value)) {
+            return borrow<Instance>(value);
+        }
+        if (is<SharedPtr<BoundMethod>>(value)) {
+            return borrow<BoundMethod>(value);
+        }
+        if (is<SharedPtr<WeakRef>>(value)) {
+            return borrow<WeakRef>(value);
+        }
+        if (is<SharedPtr<WeakMap>>(value)) {
+            return borrow<WeakMap>(value);
+        }
+        return nullptr;
+    }
+
+    static std::string toString(StringView sv) {
+        return std::string(sv.begin(), sv.size());
+    }
+
+    void HeapDump::addRoot(StringView name, const Value& value) {
+        auto node = add(value);
+        if (node != NOT_ON_HEAP) {
+            roots.push_back(Root{node, toString(name)});
+        }
+    }
+
+    uint32_t HeapDump::add(const Value& value) {
+        auto object = identity(value);
+        if (!object) {
+            return NOT_ON_HEAP;
+        }
+        auto [it, added] = ids.try_emplace(object, uint32_t(nodes.size()));
+        if (added) {
+            nodes.emplace_back();
+            values.push_back(value);
+        }
+        return it->second;
+    }
+
+    // marking is pointed at a list, so tracing the object hands over what it refers to
+    void HeapDump::addEdges(uint32_t index, const Traced& object) {
+        std::vector<Value> children;
+        collector.gatherInto(&children);
+        object.trace(collector);
+        collector.gatherInto(nullptr);
+        for (const auto& child : children) {
+            auto node = add(child);
+            if (node != NOT_ON_HEAP) {
+                nodes[index].edges.push_back(node);
+            }
+        }
+    }
+
+    // fills in the node, which can add more nodes, so it is looked up again after each add
+    void HeapDump::expand(uint32_t index) {
+        const Value value = values[index];
+        if (isString(value)) {
+            auto string = as<InternedString>(value);
+            nodes[index].kind = Kind::String;
+            nodes[index].size = sizeof(String) + string.size();
+            nodes[index].name = std::string(string.begin(), std::min(string.size(), STRING_NAME_LENGTH));
+        } else if (is<SharedPtr<Function>>(value)) {
+            auto function = borrow<Function>(value);
+            const Chunk* chunk = *function->getChunk();
+            nodes[index].kind = Kind::Function;
+            nodes[index].size = sizeof(Function) + sizeof(Chunk) + chunk->size();
+            nodes[index].name = toString(function->getName());
+            for (size_t constant = 0; constant < chunk->getConstantCount(); ++constant) {
+                auto node = add(chunk->getConstant(constant));
+                if (node != NOT_ON_HEAP) {
+                    nodes[index].edges.push_back(node);
+                }
+            }
+        } else if (is<SharedPtr<NativeFunction>>(value)) {
+            nodes[index].kind = Kind::Native;
+            nodes[index].size = sizeof(NativeFunction);
+        } else if (is<SharedPtr<Closure>>(value)) {
+            auto closure = borrow<Closure>(value);
+            nodes[index].kind = Kind::Closure;
+            nodes[index].size = closure->heapSize();
+            nodes[index].name = toString(closure->getFunction()->getName());
+            // the function isn't traced, as it can't be part of a cycle
+            auto function = add(Value{closure->getFunction()});
+            nodes[index].edges.push_back(function);
+            addEdges(index, *closure);
+        } else if (is<SharedPtr<UpValueObj>>(value)) {
+            nodes[index].kind = Kind::UpValue;
+            nodes[index].size = sizeof(UpValueObj);
+            addEdges(index, *borrow<UpValueObj>(value));
+        } else if (is<SharedPtr<Class>>(value)) {
+            auto cls = borrow<Class>(value);
+            nodes[index].kind = Kind::Class;
+            nodes[index].size = cls->heapSize();
+            nodes[index].name = toString(cls->getName());
+            addEdges(index, *cls);
+        } else if (is<SharedPtr<Instance>>(value)) {
+            auto instance = borrow<Instance>(value);
+            nodes[index].kind = Kind::Instance;
+            nodes[index].size = instance->heapSize();
+            nodes[index].name = toString(instance->getName());
+            addEdges(index, *instance);
+        } else if (is<SharedPtr<BoundMethod>>(value)) {
+            auto method = borrow<BoundMethod>(value);
+            nodes[index].kind = Kind::BoundMethod;
+            nodes[index].size = sizeof(BoundMethod);
+            nodes[index].name = toString(getFunction(method->getMethod())->getName());
+            addEdges(index, *method);
+        } else if (is<SharedPtr<WeakRef>>(value)) {
+            // no edge, what it refers to isn't kept alive by it
+            nodes[index].kind = Kind::WeakRef;
+            nodes[index].size = sizeof(WeakRef);
+        } else if (is<SharedPtr<WeakMap>>(value)) {
+            auto map = borrow<WeakMap>(value);
+            nodes[index].kind = Kind::WeakMap;
+            nodes[index].size = map->heapSize();
+            addEdges(index, *map);
+        }
+    }
+
+    template <typename T>
+    static void put(std::ofstream& out, T value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static void put(std::ofstream& out, const std::string& s) {
+        put(out, uint32_t(s.size()));
+        out.write(s.data(), s.size());
+    }
+
+    void HeapDump::write(const char* path) {
+        // expanding a node adds the ones it refers to at the end, so this reaches everything
+        for (uint32_t index = 0; index < nodes.size(); ++index) {
+            expand(index);
+        }
+        values.clear();
+
+        std::ofstream out(path, std::ios::binary);
+        if (!out) {
+            throw Exception(std::format("Can't write a heap dump to {}", path).c_str(), nullptr);
+        }
+        out.write(heapformat::MAGIC, sizeof(heapformat::MAGIC));
+        put(out, heapformat::VERSION);
+        put(out, uint32_t(nodes.size()));
+        for (const auto& node : nodes) {
+            put(out, node.kind);
+            put(out, node.size);
+            put(out, node.name);
+            put(out, uint32_t(node.edges.size()));
+            for (auto edge : node.edges) {
+                put(out, edge);
+            }
+        }
+        put(out, uint32_t(roots.size()));
+        for (const auto& root : roots) {
+            put(out, root.node);
+            put(out, root.name);
+        }
+        if (!out) {
+            throw Exception(std::format("Can't write a heap dump to {}", path).c_str(), nullptr);
+        }
+    }
+}
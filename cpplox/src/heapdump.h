@@ -0,0 +1,48 @@
+#ifndef CPPLOX_HEAPDUMP_H_
+#define CPPLOX_HEAPDUMP_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "heapformat.h"
+#include "string.h"
+#include "value.h"
+
+// Walks everything reachable from the roots it is given and writes it out in the heap format, for
+// finding out what keeps memory alive. What an object refers to is found by tracing it the way the
+// collector does. The walk only keeps values, it doesn't change anything, but it has to be done at
+// a safepoint. Its own tables use the standard allocator, they shouldn't show up in what they describe
+namespace lox {
+    class HeapDump {
+    public:
+        // name says what holds the value, like the name of a global
+        void addRoot(StringView name, const Value& value);
+        // throws when the file can't be written
+        void write(const char* path);
+
+    private:
+        static constexpr uint32_t NOT_ON_HEAP = UINT32_MAX;
+        struct Node {
+            heapformat::Kind kind = heapformat::Kind::String;
+            uint64_t size = 0;
+            std::string name;
+            std::vector<uint32_t> edges;
+        };
+        struct Root {
+            uint32_t node;
+            std::string name;
+        };
+
+        uint32_t add(const Value& value);
+        void expand(uint32_t index);
+        void addEdges(uint32_t index, const Traced& object);
+
+        std::unordered_map<const void*, uint32_t> ids;
+        std::vector<Node> nodes;
+        std::vector<Value> values;  // the value of each node, holding it until the walk is done
+        std::vector<Root> roots;
+    };
+}
+#endif
@@ -0,0 +1,32 @@
+#ifndef CPPLOX_HEAPFORMAT_H_
+#define CPPLOX_HEAPFORMAT_H_
+
+#include <cstdint>
+
+// The file a heap dump writes, read back by the heap analyzer. Everything is in the byte order of
+// the machine that wrote it, strings are a uint32_t length and the bytes:
+//   the magic and a uint32_t version
+//   a uint32_t node count, then each node: a uint8_t kind, a uint64_t size in bytes, its name, a
+//   uint32_t edge count and the uint32_t index of each node it refers to
+//   a uint32_t root count, then each root: the uint32_t index of its node and what holds it
+// A node's size is the object with the storage it owns, what it refers to is left to the edges
+namespace lox::heapformat {
+    constexpr char MAGIC[8] = {'L', 'O', 'X', 'H', 'E', 'A', 'P', '\0'};
+    constexpr uint32_t VERSION = 2;
+
+    enum class Kind : uint8_t {
+        String,
+        Function,
+        Native,
+        Closure,
+        UpValue,
+        Class,
+        Instance,
+        BoundMethod,
+        WeakRef,
+        WeakMap
+    };
+
+    constexpr const char* KIND_NAMES[] = {"string", "function", "native", "closure", "upvalue", "class", "instance", "bound method", "weak ref", "weak map"};
+}
+#endif
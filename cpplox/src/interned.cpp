@@ -18,6 +18,23 @@ namespace lox {
         str = getStrings().insert({sv}).str;
     }
 
+    InternedString::InternedString(SharedPtr<String> interned) : str(std::move(interned)) {
+    }
+
+    SharedPtr<String> InternedString::shared() const {
+        if (std::holds_alternative<SharedPtr<String>>(str)) {
+            return std::get<SharedPtr<String>>(str);
+        }
+        auto& strings = getStrings();
+        auto entry = strings.get(Impl{str});
+        if (entry.hasValue() && std::holds_alternative<SharedPtr<String>>(entry.value().str)) {
+            return std::get<SharedPtr<String>>(entry.value().str);
+        }
+        auto owned = SharedPtr<String>::Make(begin(), size());
+        strings.replace(Impl{owned});
+        return owned;
+    }
+
     size_t InternedString::size() const {
         if (std::holds_alternative<StringView>(str)) {
             return std::get<StringView>(str).size();
@@ -14,6 +14,8 @@ namespace lox {
         InternedString() : InternedString(StringView(nullptr, nullptr)) {}
         InternedString(String str);
         InternedString(StringView sv);
+        // wraps a string that was already interned, without looking it up again
+        explicit InternedString(SharedPtr<String> interned);
         using UnderlyingString = std::variant<SharedPtr<String>, StringView>;
         struct Impl {
             UnderlyingString str;
@@ -35,6 +37,9 @@ namespace lox {
         size_t getHash() const;
 
         StringView string() const;
+        // the string as an owned heap object. A view is copied out of the source the first time, and
+        // the copy takes the view's place in the table, so every later call gets that same object
+        SharedPtr<String> shared() const;
 
         friend bool operator==(InternedString i1, InternedString i2) {
             return ranges::is_equal(i1, i2);
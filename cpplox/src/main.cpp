@@ -1,13 +1,20 @@
 #include <cassert>
+#include <charconv>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
+#include <iostream>
 #include <print>
 
 #include "chunk.h"
+#include "collector.h"
 #include "common.h"
 #include "debug.h"
 #include "file.h"
 #include "loxexception.h"
 #include "memory.h"
+#include "profiler.h"
 #include "string.h"
 #include "vm.h"
 
@@ -52,20 +59,122 @@ void memtest() {
     block2 = lox::reallocate(block2, 64, 0);
 }
 
+static void reportHugePages() {
+    auto usage = lox::arena.pageUsage();
+    std::println(std::cerr, "Heap on huge pages: {} of {} kB", usage.huge / 1024, usage.resident / 1024);
+}
+
+// the heap and everything in it go with the process, freeing it all object by object first
+// would only make a big program slow to finish
+[[noreturn]] static void exitWithoutTeardown(int code) {
+    std::cout.flush();
+    std::fflush(nullptr);
+    std::_Exit(code);
+}
+
+static void onHeapDumpSignal(int) {
+    lox::VM::requestHeapDump();
+}
+
+// objects marked, swept or freed between instructions when the work is spread out
+constexpr size_t DEFAULT_SLICE_BUDGET = 1000;
+// the percentage of the arena left in holes that has a full collection compact the buffers objects own
+constexpr size_t DEFAULT_COMPACT_BUFFERS_ABOVE = 25;
+
+static void usage() {
+    std::println(std::cerr, "Usage: clox [--gc-stress] [--gc-incremental[=budget]] [--gc-threads=N] [--gc-trial-deletion] [--gc-compact-buffers[=percent]] [--hugepages] [--heap-report] [--memory-limit=MB] [--clean-exit] [path]");
+}
+
+// the positive number after the '=' of an option
+static bool parseCount(const std::string& arg, size_t& count) {
+    auto value = arg.substr(arg.find('=') + 1);
+    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), count);
+    return error == std::errc{} && end == value.data() + value.size() && count > 0;
+}
+
 int main(int argc, const char* argv[]) {
     try {
         lox::VM vm;
-        if (argc == 1) {
-            repl(vm);
-        } else if (argc == 2) {
-            if (std::string(argv[1]) == "--memtest") {
+        // kill -USR1 writes out the heap of a running script
+        std::signal(SIGUSR1, onHeapDumpSignal);
+        const char* path = nullptr;
+        bool hugePages = false;
+        bool heapReport = false;
+        bool cleanExit = false;  // destroys the VM and the heap on the way out, for leak checking
+        for (int index = 1; index < argc; ++index) {
+            std::string arg = argv[index];
+            if (arg == "--memtest") {
                 memtest();
                 return 0;
+            } else if (arg == "--gc-stress") {
+                lox::collector.stress = true;
+            } else if (arg == "--gc-incremental") {
+                lox::collector.sliceBudget = DEFAULT_SLICE_BUDGET;
+                lox::freeQueue.budget = DEFAULT_SLICE_BUDGET;
+            } else if (arg.starts_with("--gc-incremental=")) {
+                if (!parseCount(arg, lox::collector.sliceBudget)) {
+                    usage();
+                    return 64;
+                }
+                lox::freeQueue.budget = lox::collector.sliceBudget;
+            } else if (arg == "--hugepages") {
+                hugePages = true;
+                if (!lox::arena.useHugePages()) {
+                    std::println(std::cerr, "Huge pages are not available, using normal pages");
+                }
+            } else if (arg == "--clean-exit") {
+                cleanExit = true;
+            } else if (arg == "--heap-report") {
+                heapReport = true;
+                lox::profiler.counting = true;
+                lox::profiler.trackSites = true;
+            } else if (arg == "--gc-compact-buffers") {
+                lox::collector.compactBuffersAbove = DEFAULT_COMPACT_BUFFERS_ABOVE / 100.0;
+            } else if (arg.starts_with("--gc-compact-buffers=")) {
+                size_t percent = 0;
+                if (!parseCount(arg, percent) || percent >= 100) {
+                    usage();
+                    return 64;
+                }
+                lox::collector.compactBuffersAbove = double(percent) / 100.0;
+            } else if (arg.starts_with("--memory-limit=")) {
+                size_t megabytes = 0;
+                if (!parseCount(arg, megabytes)) {
+                    usage();
+                    return 64;
+                }
+                vm.setMemoryLimit(megabytes * 1024 * 1024);
+            } else if (arg == "--gc-trial-deletion") {
+                lox::collector.useTrialDeletion();
+            } else if (arg.starts_with("--gc-threads=")) {
+                if (!parseCount(arg, lox::collector.threads)) {
+                    usage();
+                    return 64;
+                }
+            } else if (!path && !arg.starts_with("--")) {
+                path = argv[index];
+            } else {
+                usage();
+                return 64;
             }
-            auto result = runFile(vm, argv[1]);
-            return std::to_underlying(result);
+        }
+        if (!path) {
+            repl(vm);
         } else {
-            std::println(std::cerr, "Usage: clox[path]");
+            auto result = runFile(vm, path);
+            if (hugePages) {
+                reportHugePages();
+            }
+            if (heapReport) {
+                // the sites go before the profiler does, and nothing after this needs them
+                lox::profiler.trackSites = false;
+                std::print(std::cerr, "{}", lox::profiler.report());
+                std::println(std::cerr, "\nThe VM had {} bytes in use at the end, {} at peak", vm.memoryUsed(), vm.peakMemoryUsed());
+            }
+            if (!cleanExit) {
+                exitWithoutTeardown(std::to_underlying(result));
+            }
+            return std::to_underlying(result);
         }
     } catch (lox::BadAllocException e) {
         std::println("Bad alloc: {}", e);
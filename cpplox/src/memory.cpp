@@ -1,18 +1,28 @@
 #include "memory.h"
 
+#include <bit>
 #include <cstring>
+#include <fstream>
+#include <mutex>
 #include <print>
+#include <string>
 #include <utility>
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "algorithm.h"
+#include "collector.h"
 #include "loxexception.h"
 namespace lox {
     size_t poolSizes[] = {1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7, 1 << 8, 1 << 9,
                           1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, 1 << 15, 1 << 16, 1 << 17, 1 << 18, 1 << 19,
                           1 << 20, 1 << 21, 1 << 22, 1 << 23, 1 << 24, 1 << 25, 1 << 26, 1 << 27, 1 << 28, 1 << 29,
                           1 << 30, 1uz << 31};
-    size_t getPoolSize(size_t index) {
-        return poolSizes[index + 3] - 1;  // take off 1 byte for the size that has to go in the first byte
+    // what is left of a block once the header in front of the data is taken off, the header holds
+    // the pool index in its first and last byte and is as big as the data's alignment
+    size_t getPoolSize(size_t index, size_t header = Arena::MIN_ALIGNMENT) {
+        return poolSizes[index + 3] > header ? poolSizes[index + 3] - header : 0;
     }
 
     // can't use endianess because we want our msb in the first byte
@@ -28,41 +38,158 @@ namespace lox {
     }
 
     Arena arena;
+    thread_local constinit Nursery nursery;
+    thread_local constinit MemoryBudget* currentBudget = nullptr;
+    thread_local constinit FreeQueue freeQueue;
+    Slabs slabs;
+    // guards the arena and the slabs
+    std::mutex heapLock;
+    // defined after the arena so it is destroyed first, what it buffers is allocated there
+    Collector collector;
+
+    // the bits for pool i start after those of every smaller pool, and pool i has 2^(27 - i) blocks
+    size_t freeBitIndex(size_t poolIndex, size_t offset) {
+        return (1uz << 28) - (1uz << (28 - poolIndex)) + (offset >> (poolIndex + 3));
+    }
+
+    // the free lists link blocks by where they are in 8 byte units, so a link fits in 31 bits
+    uint32_t Arena::linkTo(const std::byte* block) const {
+        return static_cast<uint32_t>((block - memory) / 8);
+    }
+
+    std::byte* Arena::linked(uint32_t link) const {
+        return memory + size_t{link} * 8;
+    }
 
+    // the address space for every region is reserved up front and nothing is backed by memory
+    // until a region is opened, even then a page only costs something once it is touched
+    // the start is rounded up to a huge page so the regions can be backed by them
     Arena::Arena() {
         lox::ranges::fill(pools, POOL_SENTINEL);
-        memory = (std::byte*)malloc(_1GB);
-        // lox::ranges::fill_n(memory, _1GB, std::byte{128});  // mark all as free
-        if (!memory) {
+        lox::ranges::fill(freeFrom, 0uz);
+        void* reserved = mmap(nullptr, RESERVATION, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reserved == MAP_FAILED) {
+            throw Exception("Could not reserve the arena", nullptr);
+        }
+        reservation = static_cast<std::byte*>(reserved);
+        memory = reinterpret_cast<std::byte*>((reinterpret_cast<uintptr_t>(reserved) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if (!addRegion()) {
             throw Exception("Could not allocate arena", nullptr);
         }
+    }
+
+    bool Arena::addRegion() {
+        if (regions == MAX_REGIONS) {
+            return false;
+        }
+        auto region = memory + regions * REGION_SIZE;
+        if (mprotect(region, REGION_SIZE, PROT_READ | PROT_WRITE) != 0) {
+            return false;
+        }
+        if (hugePages) {
+            madvise(region, REGION_SIZE, MADV_HUGEPAGE);
+        }
+        // zeroed pages come in as they are touched, so only the levels being used cost anything
+        freeBits[regions] = static_cast<uint64_t*>(calloc((1uz << 28) / 64, sizeof(uint64_t)));
+        if (!freeBits[regions]) {
+            mprotect(region, REGION_SIZE, PROT_NONE);
+            return false;
+        }
+        regions++;
+        addToFreePool(27, region);
+        return true;
+    }
 
-        addToFreePool(27, memory);
+    // hands the pages of a big free block back to the OS, all but the first which holds its links,
+    // and with huge pages all of the first one so it isn't broken up
+    void Arena::release(std::byte* block, size_t poolIndex) {
+        static const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t kept = hugePages ? HUGE_PAGE_SIZE : pageSize;
+        if (poolIndex < RELEASE_POOL || poolSizes[poolIndex + 3] <= kept) {
+            return;
+        }
+        madvise(block + kept, poolSizes[poolIndex + 3] - kept, MADV_DONTNEED);
     }
 
-    void* Arena::allocate(size_t requested) {
-        for (size_t index = 0; index < 28; ++index) {
-            if (pools[index] == POOL_SENTINEL || getPoolSize(index) < requested) {
-                continue;
+    bool Arena::useHugePages() {
+        for (size_t region = 0; region < regions; ++region) {
+            if (madvise(memory + region * REGION_SIZE, REGION_SIZE, MADV_HUGEPAGE) != 0) {
+                return false;  // the kernel can't do it, so stay on normal pages
             }
-            // at this point, we should have a pool that fits
-            auto pool = popBlockFromPool(index);
-            shrinkBlockToRequestedSize(index, pool, requested);
-            return static_cast<void*>(pool + 1);
         }
+        hugePages = true;
+        return true;
+    }
 
-        return nullptr;
+    // what the kernel says about the arena's mappings, from /proc/self/smaps
+    Arena::PageUsage Arena::pageUsage() const {
+        PageUsage usage;
+        std::ifstream smaps("/proc/self/smaps");
+        std::string line;
+        bool inArena = false;
+        while (std::getline(smaps, line)) {
+            auto colon = line.find(':');
+            auto dash = line.find('-');
+            if (dash != std::string::npos && (colon == std::string::npos || dash < colon)) {
+                // the first line of a mapping, its range in hex
+                auto start = reinterpret_cast<std::byte*>(std::stoull(line.substr(0, dash), nullptr, 16));
+                inArena = start >= reservation && start < reservation + RESERVATION;
+            } else if (inArena && line.starts_with("Rss:")) {
+                usage.resident += std::stoull(line.substr(colon + 1)) * 1024;
+            } else if (inArena && line.starts_with("AnonHugePages:")) {
+                usage.huge += std::stoull(line.substr(colon + 1)) * 1024;
+            }
+        }
+        return usage;
+    }
+
+    void* Arena::allocate(size_t requested, size_t alignment) {
+        if (!std::has_single_bit(alignment) || alignment > MAX_ALIGNMENT) {
+            throw lox::Exception("Alignment has to be a power of two no bigger than a page", nullptr);
+        }
+        size_t header = std::max(alignment, MIN_ALIGNMENT);
+        if (requested > getPoolSize(27, header)) {
+            return nullptr;
+        }
+        // the smallest pool that fits, then the first one from there that has a block
+        auto smallest = std::max<size_t>(std::bit_width(requested + header - 1), 3) - 3;
+        auto candidates = nonEmptyPools & ~((1u << smallest) - 1);
+        if (candidates == 0) {
+            if (!addRegion()) {
+                return nullptr;
+            }
+            candidates = nonEmptyPools & ~((1u << smallest) - 1);
+        }
+        auto index = static_cast<size_t>(std::countr_zero(candidates));
+        auto pool = popBlockFromPool(index);
+        shrinkBlockToRequestedSize(index, pool, requested, header);
+        inUse += poolSizes[static_cast<size_t>(*pool) + 3];
+        return static_cast<void*>(pool + header);
     }
 
-    void Arena::shrinkBlockToRequestedSize(size_t poolIndex, std::byte* block, size_t newSize) {
+    void Arena::shrinkBlockToRequestedSize(size_t poolIndex, std::byte* block, size_t newSize, size_t header) {
         // while a smaller block could fit this, split this block in half and store its buddy
-        while (poolIndex > 0 && getPoolSize(poolIndex - 1) > newSize) {
+        while (poolIndex > 0 && getPoolSize(poolIndex - 1, header) > newSize) {
             poolIndex--;
             auto buddy = getBuddy(poolIndex, block);
             addToFreePool(poolIndex, buddy);
         }
-        *block = std::byte{static_cast<uint8_t>(poolIndex)};
+        markAllocated(block, poolIndex, header);
+    }
+
+    void Arena::markAllocated(std::byte* block, size_t poolIndex, size_t header) {
+        block[0] = std::byte{static_cast<uint8_t>(poolIndex)};
+        block[header - 1] = std::byte{static_cast<uint8_t>(poolIndex)};  // so the data can find its block
+    }
+
+    std::byte* Arena::blockOf(void* data) const {
+        auto poolIndex = static_cast<uint8_t>(static_cast<std::byte*>(data)[-1]);
+        if (poolIndex >= 28) {
+            throw lox::Exception("We've detected some sort of corruption and can't find this block", nullptr);
+        }
+        return blockContaining(static_cast<std::byte*>(data) - 1, poolSizes[poolIndex + 3]);
     }
+
     void Arena::verifyNotFreed(std::byte* block) const {
         if (isFree(block)) {
             throw lox::Exception("Trying to free block that has already been freed", nullptr);
@@ -80,19 +207,21 @@ namespace lox {
     }
 
     void Arena::deallocate(void* rawBlock) {
-        auto blockStart = static_cast<std::byte*>(rawBlock) - 1;
+        auto blockStart = blockOf(rawBlock);
         verifyNotFreed(blockStart);
         verifyAllocatedBlockHasValidPoolSize(blockStart);
         auto poolIndex = static_cast<size_t>(*blockStart);
+        inUse -= poolSizes[poolIndex + 3];
         // while we have a buddy, combine it and move it up the pool
         auto leftMostBlock = blockStart;
         auto buddy = getBuddy(poolIndex, blockStart);
         while (poolIndex < 27 && isInFreeList(buddy, poolIndex)) {
-            removeBlockFromPool(buddy);
+            removeBlockFromPool(buddy, poolIndex);
             poolIndex++;
             leftMostBlock = std::min(leftMostBlock, buddy);
             buddy = getBuddy(poolIndex, leftMostBlock);
         }
+        release(leftMostBlock, poolIndex);
         addToFreePool(poolIndex, leftMostBlock);
     }
 
@@ -104,85 +233,156 @@ namespace lox {
         if (newSize > _1GB) {
             throw lox::Exception("Can not allocate more than one gigabyte in the arena", nullptr);
         }
-        auto blockStart = static_cast<std::byte*>(rawBlock) - 1;
+        auto blockStart = blockOf(rawBlock);
         verifyNotFreed(blockStart);
         verifyAllocatedBlockHasValidPoolSize(blockStart);
         auto poolIndex = static_cast<uint32_t>(*blockStart);
-        if (isRequestedSizeAlreadyInCorrectPool(poolIndex, newSize)) {
+        // the header stays the same size so the data keeps its alignment
+        size_t header = static_cast<std::byte*>(rawBlock) - blockStart;
+        if (isRequestedSizeAlreadyInCorrectPool(poolIndex, newSize, header)) {
             return rawBlock;
-        } else if (getPoolSize(poolIndex) < newSize) {
-            auto block = growBlock(blockStart, poolIndex, newSize);
-            return static_cast<void*>(block + 1);
+        } else if (getPoolSize(poolIndex, header) < newSize) {
+            auto block = growBlock(blockStart, poolIndex, newSize, header);
+            return block ? static_cast<void*>(block + header) : nullptr;
         } else {
-            auto block = shrinkBlock(blockStart, poolIndex, newSize);
-            return static_cast<void*>(block + 1);
+            auto block = shrinkBlock(blockStart, poolIndex, newSize, header);
+            return static_cast<void*>(block + header);
+        }
+        return nullptr;
+    }
+
+    // Compaction slides blocks down into the lowest free block that fits, found from the free bits.
+    // The search for each pool starts where the last one left off, as only a free block put on
+    // the pool's list can be lower than that, and adding one moves the start back
+    void* Arena::relocate(void* data) {
+        auto block = blockOf(data);
+        verifyNotFreed(block);
+        auto poolIndex = static_cast<size_t>(*block);
+        size_t header = static_cast<std::byte*>(data) - block;
+        // a bigger block lower down does as well, the part of it that isn't needed is split off
+        std::byte* target = nullptr;
+        size_t targetIndex = poolIndex;
+        size_t limit = block - memory;
+        for (size_t index = poolIndex; index < 28; ++index) {
+            if (auto found = lowestFreeBlock(index, limit)) {
+                target = found;
+                targetIndex = index;
+                limit = found - memory;
+            }
+        }
+        if (!target) {
+            return data;
         }
+        removeBlockFromPool(target, targetIndex);
+        while (targetIndex > poolIndex) {
+            targetIndex--;
+            addToFreePool(targetIndex, getBuddy(targetIndex, target));
+        }
+        markAllocated(target, poolIndex, header);
+        memcpy(target + header, data, getPoolSize(poolIndex, header));
+        inUse += poolSizes[poolIndex + 3];
+        deallocate(data);
+        return target + header;
+    }
+
+    // the free block of the pool that is lowest in the arena, if there is one before limit
+    std::byte* Arena::lowestFreeBlock(size_t poolIndex, size_t limit) {
+        limit = std::min(limit, regions * REGION_SIZE);
+        size_t blockSize = poolSizes[poolIndex + 3];
+        size_t level = freeBitIndex(poolIndex, 0);
+        for (size_t offset = freeFrom[poolIndex]; offset < limit; offset = (offset / REGION_SIZE + 1) * REGION_SIZE) {
+            size_t region = offset / REGION_SIZE;
+            auto bits = freeBits[region];
+            size_t end = level + (std::min(limit - region * REGION_SIZE, REGION_SIZE) + blockSize - 1) / blockSize;
+            for (size_t bit = freeBitIndex(poolIndex, offset % REGION_SIZE); bit < end; bit += 64 - bit % 64) {
+                if (uint64_t word = bits[bit / 64] >> (bit % 64)) {
+                    bit += static_cast<size_t>(std::countr_zero(word));
+                    if (bit >= end) {
+                        break;
+                    }
+                    freeFrom[poolIndex] = region * REGION_SIZE + (bit - level) * blockSize;
+                    return memory + freeFrom[poolIndex];
+                }
+            }
+        }
+        freeFrom[poolIndex] = std::max(freeFrom[poolIndex], limit);
         return nullptr;
     }
 
-    std::byte* Arena::growBlock(std::byte* block, size_t poolIndex, size_t newSize) {
-        size_t poolSize = getPoolSize(poolIndex);
+    std::byte* Arena::growBlock(std::byte* block, size_t poolIndex, size_t newSize, size_t header) {
+        size_t poolSize = getPoolSize(poolIndex, header);
+        // find if we can grow to our block without copying, merging with free buddies the way a free does
         size_t targetIndex = poolIndex;
-        auto buddy = getBuddy(targetIndex, block);
-        // find if we can grow to our block without copying
-        while (targetIndex < 27 && getPoolSize(targetIndex + 1) < newSize && isInFreeList(buddy, targetIndex)) {
+        auto merged = block;
+        while (targetIndex < 27 && getPoolSize(targetIndex, header) < newSize) {
+            auto buddy = getBuddy(targetIndex, merged);
+            if (!isInFreeList(buddy, targetIndex)) {
+                break;
+            }
+            merged = std::min(merged, buddy);
             targetIndex++;
-            buddy = getBuddy(targetIndex, block);
         }
         // if we have a target index that we can grow to
-        if (targetIndex < 27 && isInFreeList(buddy, targetIndex)) {
-            auto leftmostFreeBlock = block;
-            for (size_t index = poolIndex; index <= targetIndex; ++index) {
-                auto buddy = getBuddy(index, block);
-                leftmostFreeBlock = std::min(buddy, leftmostFreeBlock);
-                removeBlockFromPool(buddy);
+        if (getPoolSize(targetIndex, header) >= newSize) {
+            merged = block;
+            for (size_t index = poolIndex; index < targetIndex; ++index) {
+                auto buddy = getBuddy(index, merged);
+                removeBlockFromPool(buddy, index);
+                merged = std::min(merged, buddy);
             }
-            if (leftmostFreeBlock < block) {
-                memcpy(leftmostFreeBlock + 1, block + 1, poolSize);
+            if (merged < block) {
+                memcpy(merged + header, block + header, poolSize);
             }
             // write new size in the block
-            block = leftmostFreeBlock;
-            *block = std::byte{static_cast<uint8_t>(targetIndex + 1)};
-            return block;
+            markAllocated(merged, targetIndex, header);
+            inUse += poolSizes[targetIndex + 3] - poolSizes[poolIndex + 3];
+            return merged;
         }
 
         // we need to copy data over
-        auto newBlock = static_cast<std::byte*>(allocate(newSize));
+        auto newBlock = static_cast<std::byte*>(allocate(newSize, header));
         if (newBlock == nullptr) {
             return nullptr;  // failed to allocate new block
         }
-        memcpy(newBlock, block + 1, poolSize);
-        deallocate(block + 1);
-        return newBlock - 1;
+        memcpy(newBlock, block + header, poolSize);
+        deallocate(block + header);
+        return newBlock - header;
     }
 
-    std::byte* Arena::shrinkBlock(std::byte* block, size_t poolIndex, size_t newSize) {
-        if (poolIndex == 0 || getPoolSize(poolIndex - 1) < newSize) {
+    std::byte* Arena::shrinkBlock(std::byte* block, size_t poolIndex, size_t newSize, size_t header) {
+        if (poolIndex == 0 || getPoolSize(poolIndex - 1, header) < newSize) {
             return block;
         }
-        shrinkBlockToRequestedSize(poolIndex, block, newSize);
+        shrinkBlockToRequestedSize(poolIndex, block, newSize, header);
+        inUse -= poolSizes[poolIndex + 3] - poolSizes[static_cast<size_t>(*block) + 3];
         return block;
     }
-    bool Arena::isRequestedSizeAlreadyInCorrectPool(uint32_t poolIndex, size_t newSize) const {
-        return getPoolSize(poolIndex) >= newSize && (poolIndex == 0 || getPoolSize(poolIndex - 1) <= newSize);
+    bool Arena::isRequestedSizeAlreadyInCorrectPool(uint32_t poolIndex, size_t newSize, size_t header) const {
+        return getPoolSize(poolIndex, header) >= newSize && (poolIndex == 0 || getPoolSize(poolIndex - 1, header) <= newSize);
     }
 
     std::byte* Arena::getBuddy(size_t index, std::byte* block) const {
-        uint32_t offset = block - memory;
-        uint32_t buddyOffset = offset ^ (1 << (index + 3));
+        size_t offset = block - memory;
+        size_t buddyOffset = offset ^ (1uz << (index + 3));
         return memory + buddyOffset;
     }
 
     bool Arena::isInFreeList(std::byte* block, size_t targetIndex) const {
-        auto current = pools[targetIndex];
-        while (current != POOL_SENTINEL) {
-            if (memory + current == block) {
-                return true;
-            }
+        size_t offset = block - memory;
+        auto bits = freeBits[offset / REGION_SIZE];
+        auto bit = freeBitIndex(targetIndex, offset % REGION_SIZE);
+        return bits[bit / 64] & (uint64_t{1} << (bit % 64));
+    }
 
-            current = readIntFromMemory(memory + current + 4);
+    void Arena::setInFreeList(std::byte* block, size_t poolIndex, bool free) {
+        size_t offset = block - memory;
+        auto bits = freeBits[offset / REGION_SIZE];
+        auto bit = freeBitIndex(poolIndex, offset % REGION_SIZE);
+        if (free) {
+            bits[bit / 64] |= uint64_t{1} << (bit % 64);
+        } else {
+            bits[bit / 64] &= ~(uint64_t{1} << (bit % 64));
         }
-        return false;
     }
     bool Arena::isFree(std::byte* block) const {
         return static_cast<uint8_t>(*block) >= 128;  // if first bit is set
@@ -191,44 +391,468 @@ namespace lox {
     // this does NOT free the block or write the size, its assumed that the caller will do that
     // if needed (this is becasue sometimes a block is removed and added to a bigger block)
     // which does not need its own size tracking
-    void Arena::removeBlockFromPool(std::byte* block) {
+    void Arena::removeBlockFromPool(std::byte* block, size_t poolIndex) {
         verifyFreed(block);
         auto previousIndex = readIntFromMemory(block) & 0x7FFFFFFF;
         auto nextIndex = readIntFromMemory(block + 4);
         if (previousIndex != POOL_SENTINEL) {
-            auto previousBlock = memory + previousIndex;
+            auto previousBlock = linked(previousIndex);
             writeIntToMemory(previousBlock + 4, nextIndex);
         }
         if (nextIndex != POOL_SENTINEL) {
-            auto nextBlock = memory + nextIndex;
+            auto nextBlock = linked(nextIndex);
             writeIntToMemory(nextBlock, previousIndex);
             nextBlock[0] |= std::byte{1 << 7};  // restore free bit
         }
-        for (auto& pool : pools) {
-            if (memory + pool == block) {
-                pool = nextIndex;
+        if (previousIndex == POOL_SENTINEL) {
+            pools[poolIndex] = nextIndex;
+            if (nextIndex == POOL_SENTINEL) {
+                nonEmptyPools &= ~(1u << poolIndex);
             }
         }
+        setInFreeList(block, poolIndex, false);
+        if (poolIndex < RELEASE_POOL) {
+            stranded -= poolSizes[poolIndex + 3];
+        }
     }
 
     std::byte* Arena::popBlockFromPool(size_t poolIndex) {
-        auto poolOffset = pools[poolIndex];
-        auto block = memory + poolOffset;
-        removeBlockFromPool(block);
+        auto block = linked(pools[poolIndex]);
+        removeBlockFromPool(block, poolIndex);
         block[0] = std::byte{static_cast<uint8_t>(poolIndex)};  // clear free bit and set size so we know how to free it later
         return block;
     }
 
-    Arena::~Arena() {
-        free(memory);
+    std::byte* Arena::blockContaining(const void* data, size_t blockSize) const {
+        size_t offset = static_cast<const std::byte*>(data) - memory;
+        return memory + (offset & ~(blockSize - 1));
+    }
+
+    size_t Arena::offsetOf(const void* data) const {
+        return static_cast<const std::byte*>(data) - memory;
+    }
+
+    std::byte* Nursery::blockOf(const Chunk* chunk) {
+        return reinterpret_cast<std::byte*>(const_cast<Chunk*>(chunk)) - Arena::MIN_ALIGNMENT;
+    }
+
+    // keep the object 8 byte aligned, with its size and tag in the bytes right before it
+    std::byte* Nursery::fits(const Chunk* chunk, size_t size) {
+        auto object = reinterpret_cast<std::byte*>((reinterpret_cast<uintptr_t>(chunk->top) + HEADER + 7) & ~uintptr_t{7});
+        return object + size <= chunk->end ? object : nullptr;
+    }
+
+    // moves on to the next run of free lines past the one being bumped through, false if there is none
+    bool Nursery::nextHole(Chunk* chunk) {
+        auto block = blockOf(chunk);
+        size_t first = (chunk->end - block) / LINE_SIZE;
+        while (first < LINES && chunk->lines[first] > 0) {
+            first++;
+        }
+        if (first == LINES) {
+            return false;
+        }
+        size_t last = first;
+        while (last < LINES && chunk->lines[last] == 0) {
+            last++;
+        }
+        chunk->top = block + first * LINE_SIZE;
+        chunk->end = block + last * LINE_SIZE;
+        return true;
+    }
+
+    // every line the object or its header is on
+    void Nursery::countLines(Chunk* chunk, const std::byte* object, size_t size) {
+        auto block = blockOf(chunk);
+        for (size_t line = (object - HEADER - block) / LINE_SIZE; line <= (object + size - 1 - block) / LINE_SIZE; ++line) {
+            if (chunk->lines[line]++ == 0) {
+                chunk->usedLines++;
+            }
+        }
+    }
+
+    void* Nursery::allocate(size_t size, size_t alignment) {
+        if (size > MAX_OBJECT || alignment > Arena::MIN_ALIGNMENT) {
+            return allocateAligned(size, alignment);
+        }
+        std::byte* object = current ? fits(current, size) : nullptr;
+        while (!object) {
+            if (current && nextHole(current)) {
+                object = fits(current, size);
+                continue;
+            }
+            if (current) {
+                retire(current);
+            }
+            // anything bigger might not fit between the survivors of a recycled chunk
+            current = size <= MAX_RECYCLED_OBJECT ? takeRecyclable() : nullptr;
+            if (!current) {
+                current = newChunk();
+            }
+            object = fits(current, size);
+        }
+        auto sizeField = static_cast<uint16_t>(size);
+        memcpy(object - HEADER, &sizeField, sizeof(sizeField));
+        object[-1] = std::byte{TAG};
+        countLines(current, object, size);
+        current->top = object + size;
+        current->live++;
+        allocated += size;
+        return object;
+    }
+
+    void Nursery::deallocate(void* data) {
+        auto object = static_cast<std::byte*>(data);
+        auto block = arena.blockContaining(data, CHUNK_SIZE);
+        auto chunk = reinterpret_cast<Chunk*>(block + Arena::MIN_ALIGNMENT);
+        if (chunk->owner != this) [[unlikely]] {
+            // the line counts are the owner's alone, checked before any of them is touched
+            throw lox::Exception("A nursery object was freed on a thread other than the one that made it", nullptr);
+        }
+        uint16_t size;
+        memcpy(&size, object - HEADER, sizeof(size));
+        for (size_t line = (object - HEADER - block) / LINE_SIZE; line <= (object + size - 1 - block) / LINE_SIZE; ++line) {
+            if (--chunk->lines[line] == 0) {
+                chunk->usedLines--;
+            }
+        }
+        if (--chunk->live > 0) {
+            // a survivor doesn't keep the whole chunk, once enough around it has gone it is bumped through again
+            if (chunk != current && !chunk->recyclable && chunk->usedLines <= RECYCLE_AT) {
+                link(chunk);
+            }
+            return;
+        }
+        if (chunk == current) {
+            // nothing left in the chunk we're bumping from, so start it over
+            chunk->top = block + FIRST_LINE * LINE_SIZE;
+            chunk->end = block + CHUNK_SIZE;
+        } else {
+            if (chunk->recyclable) {
+                unlink(chunk);
+            }
+            std::scoped_lock lock(heapLock);
+            arena.deallocate(chunk);
+        }
+    }
+
+    // a chunk is a whole arena block, so it is aligned to its size within the arena and any object
+    // can find its chunk header by rounding its address down
+    Nursery::Chunk* Nursery::newChunk() {
+        std::byte* memory;
+        {
+            std::scoped_lock lock(heapLock);
+            memory = static_cast<std::byte*>(arena.allocate(CHUNK_SIZE - Arena::MIN_ALIGNMENT));
+        }
+        if (!memory) {
+            throw BadAllocException{"Could not allocate a nursery chunk", std::bad_alloc{}};
+        }
+        auto block = memory - Arena::MIN_ALIGNMENT;
+        auto chunk = std::construct_at(reinterpret_cast<Chunk*>(memory));
+        chunk->owner = this;
+        chunk->top = block + FIRST_LINE * LINE_SIZE;
+        chunk->end = block + CHUNK_SIZE;
+        return chunk;
+    }
+
+    // nothing is left to bump through, but the objects in the chunk that are still live may well
+    // have died while it was being bumped, so it can be recycled right away
+    void Nursery::retire(Chunk* chunk) {
+        if (chunk->usedLines <= RECYCLE_AT) {
+            link(chunk);
+        }
+    }
+
+    Nursery::Chunk* Nursery::takeRecyclable() {
+        while (recyclable) {
+            auto chunk = recyclable;
+            unlink(chunk);
+            // the search for a run of free lines starts right after the header
+            chunk->end = blockOf(chunk) + FIRST_LINE * LINE_SIZE;
+            if (nextHole(chunk)) {
+                return chunk;
+            }
+        }
+        return nullptr;
+    }
+
+    void Nursery::link(Chunk* chunk) {
+        chunk->previous = nullptr;
+        chunk->next = recyclable;
+        if (recyclable) {
+            recyclable->previous = chunk;
+        }
+        recyclable = chunk;
+        chunk->recyclable = true;
+    }
+
+    void Nursery::unlink(Chunk* chunk) {
+        if (chunk->previous) {
+            chunk->previous->next = chunk->next;
+        } else {
+            recyclable = chunk->next;
+        }
+        if (chunk->next) {
+            chunk->next->previous = chunk->previous;
+        }
+        chunk->previous = chunk->next = nullptr;
+        chunk->recyclable = false;
+    }
+
+    size_t Slabs::classOf(size_t size) {
+        size_t sizeClass = 0;
+        while (SIZES[sizeClass] < size) {
+            sizeClass++;
+        }
+        return sizeClass;
+    }
+
+    void* Slabs::allocate(size_t size) {
+        auto sizeClass = classOf(size);
+        auto slab = available[sizeClass];
+        if (!slab) {
+            slab = newSlab(sizeClass);
+        }
+        std::byte* block;
+        if (slab->free) {
+            block = static_cast<std::byte*>(slab->free);
+            slab->free = *reinterpret_cast<void**>(block);
+        } else {
+            block = slab->top;
+            slab->top += SIZES[sizeClass];
+        }
+        slab->live++;
+        if (slab->full()) {
+            unlink(slab);
+        }
+        return block;
+    }
+
+    void Slabs::deallocate(void* data) {
+        auto slab = slabOf(data);
+        if (slab->full()) {
+            link(slab);
+        }
+        *static_cast<void**>(data) = slab->free;
+        slab->free = data;
+        // an empty slab goes back to the arena, unless it is the only room left for its size
+        if (--slab->live == 0 && (slab->previous || slab->next)) {
+            unlink(slab);
+            setOwned(slab, false);
+            arena.deallocate(slab);
+        }
+    }
+
+    // the size class of a block is fixed for as long as its slab is around
+    size_t Slabs::classOf(const void* data) const {
+        return slabOf(data)->sizeClass;
+    }
+
+    bool Slabs::owns(const void* data) const {
+        auto index = arena.offsetOf(data) / SLAB_SIZE;
+        return index < owned.size() * 64 && (owned[index / 64].load(std::memory_order_relaxed) & (uint64_t{1} << (index % 64)));
+    }
+
+    void Slabs::setOwned(const Slab* slab, bool isOwned) {
+        auto index = arena.offsetOf(slab) / SLAB_SIZE;
+        if (isOwned) {
+            owned[index / 64].fetch_or(uint64_t{1} << (index % 64), std::memory_order_relaxed);
+        } else {
+            owned[index / 64].fetch_and(~(uint64_t{1} << (index % 64)), std::memory_order_relaxed);
+        }
+    }
+
+    // a slab is aligned to its size within the arena, same as a nursery chunk
+    Slabs::Slab* Slabs::slabOf(const void* data) const {
+        return reinterpret_cast<Slab*>(arena.blockContaining(data, SLAB_SIZE) + Arena::MIN_ALIGNMENT);
+    }
+
+    Slabs::Slab* Slabs::newSlab(size_t sizeClass) {
+        auto memory = static_cast<std::byte*>(arena.allocate(SLAB_SIZE - Arena::MIN_ALIGNMENT));
+        if (!memory) {
+            throw BadAllocException{"Could not allocate a slab", std::bad_alloc{}};
+        }
+        auto block = memory - Arena::MIN_ALIGNMENT;
+        auto slab = std::construct_at(reinterpret_cast<Slab*>(memory));
+        slab->top = block + HEADER;
+        slab->end = block + SLAB_SIZE;
+        slab->sizeClass = sizeClass;
+        setOwned(slab, true);
+        link(slab);
+        return slab;
+    }
+
+    void Slabs::link(Slab* slab) {
+        auto& head = available[slab->sizeClass];
+        slab->previous = nullptr;
+        slab->next = head;
+        if (head) {
+            head->previous = slab;
+        }
+        head = slab;
+    }
+
+    void Slabs::unlink(Slab* slab) {
+        if (slab->previous) {
+            slab->previous->next = slab->next;
+        } else {
+            available[slab->sizeClass] = slab->next;
+        }
+        if (slab->next) {
+            slab->next->previous = slab->previous;
+        }
+        slab->previous = slab->next = nullptr;
+    }
+
+    // Each thread keeps a stack of free blocks for every size class, and only takes the heap lock
+    // to move half a stack to or from the slabs
+    struct ThreadCache {
+        static constexpr size_t CAPACITY = 64;
+        static constexpr size_t BATCH = CAPACITY / 2;
+        void* blocks[Slabs::CLASSES][CAPACITY];
+        size_t counts[Slabs::CLASSES];
+
+        void* allocate(size_t sizeClass);
+        void deallocate(void* data, size_t sizeClass);
+        void flush(size_t sizeClass, size_t count);
+        static void flushOnExit();
+    };
+    thread_local constinit ThreadCache threadCache{};
+
+    // gives a thread's blocks back when it finishes, the cache still works after so a late free is fine
+    struct CacheFlusher {
+        ~CacheFlusher() {
+            for (size_t sizeClass = 0; sizeClass < Slabs::CLASSES; ++sizeClass) {
+                threadCache.flush(sizeClass, threadCache.counts[sizeClass]);
+            }
+        }
+    };
+
+    void* ThreadCache::allocate(size_t sizeClass) {
+        auto& count = counts[sizeClass];
+        if (count == 0) {
+            flushOnExit();
+            std::scoped_lock lock(heapLock);
+            for (; count < BATCH; ++count) {
+                blocks[sizeClass][count] = slabs.allocate(Slabs::SIZES[sizeClass]);
+            }
+        }
+        return blocks[sizeClass][--count];
+    }
+
+    void ThreadCache::deallocate(void* data, size_t sizeClass) {
+        if (counts[sizeClass] == 0) {
+            flushOnExit();  // a thread that only frees what others made still fills its cache
+        } else if (counts[sizeClass] == CAPACITY) {
+            flush(sizeClass, BATCH);
+        }
+        blocks[sizeClass][counts[sizeClass]++] = data;
+    }
+
+    // set up the first time a thread puts anything in its cache
+    void ThreadCache::flushOnExit() {
+        static thread_local CacheFlusher flusher;
+    }
+
+    // the oldest blocks go back, the ones freed last are the likeliest to still be in the cache
+    void ThreadCache::flush(size_t sizeClass, size_t count) {
+        {
+            std::scoped_lock lock(heapLock);
+            for (size_t index = 0; index < count; ++index) {
+                slabs.deallocate(blocks[sizeClass][index]);
+            }
+        }
+        counts[sizeClass] -= count;
+        memmove(blocks[sizeClass], blocks[sizeClass] + count, counts[sizeClass] * sizeof(void*));
+    }
+
+    void* allocateAligned(size_t size, size_t alignment) {
+        void* result;
+        if (size <= Slabs::MAX_SIZE && alignment <= Slabs::ALIGNMENT) {
+            result = threadCache.allocate(Slabs::classOf(size));
+        } else {
+            std::scoped_lock lock(heapLock);
+            result = arena.allocate(size, alignment);
+        }
+        if (!result) {
+            throw BadAllocException{"Memory allocation failed", std::bad_alloc{}};
+        }
+        return result;
+    }
+
+    // Collecting or freeing in here would run destructors in the middle of whatever is allocating,
+    // the collector's own lists included, and the VM's stack isn't all its roots yet. An overdraft
+    // more than the limit again would be more than any collection could be trusted to pay back
+    void MemoryBudget::makeRoom(size_t bytes) {
+        auto ceiling = limit > SIZE_MAX / 2 ? SIZE_MAX : 2 * limit;
+        if (bytes > ceiling - std::min(used, ceiling)) {
+            throw Exception("Out of memory", nullptr);
+        }
+        overdrawn = true;
+    }
+
+    void MemoryBudget::settle() {
+        overdrawn = false;
+        if (used > limit) {
+            throw Exception("Out of memory", nullptr);
+        }
+    }
+
+    void FreeQueue::drain(size_t count) {
+        // what destroying these lets go of is queued behind them, not destroyed in here
+        bool wasActive = std::exchange(active, true);
+        for (size_t freed = 0; freed < count && !queue.empty(); ++freed) {
+            auto deferred = queue.back();
+            queue.pop_back();
+            deferred.destroy(deferred.block);
+        }
+        active = wasActive;
+    }
+
+    void deallocateBytes(void* data) {
+        if (slabs.owns(data)) {
+            threadCache.deallocate(data, slabs.classOf(data));
+        } else if (static_cast<uint8_t>(static_cast<std::byte*>(data)[-1]) == Nursery::TAG) {
+            nursery.deallocate(data);
+        } else {
+            std::scoped_lock lock(heapLock);
+            arena.deallocate(data);
+        }
+    }
+
+    void* reallocateBytes(void* data, size_t newSize) {
+        if (newSize == 0) {
+            deallocateBytes(data);
+            return nullptr;
+        }
+        if (!slabs.owns(data)) {
+            std::scoped_lock lock(heapLock);
+            return arena.reallocate(data, newSize);
+        }
+        auto sizeClass = slabs.classOf(data);
+        if (newSize <= Slabs::MAX_SIZE && Slabs::classOf(newSize) == sizeClass) {
+            return data;
+        }
+        auto moved = allocateAligned(newSize, Slabs::ALIGNMENT);
+        memcpy(moved, data, std::min(newSize, Slabs::SIZES[sizeClass]));
+        deallocateBytes(data);
+        return moved;
+    }
+
+    void* relocateBytes(void* data) {
+        if (slabs.owns(data) || static_cast<uint8_t>(static_cast<std::byte*>(data)[-1]) == Nursery::TAG) {
+            return data;
+        }
+        std::scoped_lock lock(heapLock);
+        return arena.relocate(data);
     }
 
     void Arena::addToFreePool(size_t poolIndex, std::byte* block) {
         uint32_t firstBlockOffset = pools[poolIndex];
-        uint32_t newBlockOffset = static_cast<uint32_t>(block - memory);
+        uint32_t newBlockOffset = linkTo(block);
 
         if (firstBlockOffset != POOL_SENTINEL) {
-            std::byte* firstBlock = memory + firstBlockOffset;
+            std::byte* firstBlock = linked(firstBlockOffset);
             writeIntToMemory(firstBlock, newBlockOffset);
             firstBlock[0] |= std::byte{1 << 7};  // restore free bit
         }
@@ -237,5 +861,11 @@ namespace lox {
         writeIntToMemory(block + 4, firstBlockOffset);
         block[0] |= std::byte{1 << 7};  // no previous link, but mark as free
         pools[poolIndex] = newBlockOffset;
+        nonEmptyPools |= 1u << poolIndex;
+        setInFreeList(block, poolIndex, true);
+        freeFrom[poolIndex] = std::min(freeFrom[poolIndex], static_cast<size_t>(block - memory));
+        if (poolIndex < RELEASE_POOL) {
+            stranded += poolSizes[poolIndex + 3];
+        }
     }
 }
\ No newline at end of file
@@ -1,59 +1,380 @@
 #ifndef CLOXCPP_MEMORY_H_
 #define CLOXCPP_MEMORY_H_
 
+#include <algorithm>
 #include <atomic>
+#include <iterator>
 #include <new>
+#include <utility>
+#include <vector>
 
 #include "array.h"
 #include "common.h"
+#include "gc.h"
 #include "loxexception.h"
+#include "profiler.h"
 
 namespace lox {
     constexpr uint32_t _1GB = 1024 * 1024 * 1024;
-    constexpr uint32_t POOL_SENTINEL = _1GB;
+    constexpr size_t REGION_SIZE = _1GB;  // the arena grows a region at a time, each one the biggest block there is
+    constexpr size_t MAX_REGIONS = 8;
+    constexpr uint32_t POOL_SENTINEL = MAX_REGIONS * REGION_SIZE / 8;  // a free list link past the last region
+    static_assert(POOL_SENTINEL < (1u << 31), "free list links keep their top bit for marking blocks free");
 
     class Arena {
     public:
+        // data starts a whole header after its block, so anything up to 8 byte aligned is by default
+        static constexpr size_t MIN_ALIGNMENT = 8;
+        static constexpr size_t MAX_ALIGNMENT = 4096;
+
+        // Never torn down: objects in statics and thread_locals destroyed after it, like the interned
+        // strings, the thread caches, the nursery and the weak references, still free into it on the
+        // way out. The reservation goes with the process
         Arena();
-        ~Arena();
 
-        void* allocate(size_t size);
+        void* allocate(size_t size, size_t alignment = MIN_ALIGNMENT);
         void deallocate(void* data);
         void* reallocate(void* data, size_t newSize);
+        // moves the block into the lowest free block below it that can hold it, returns where the
+        // data is now. Whatever pointed into the block has to be updated by the caller
+        void* relocate(void* data);
+        // bytes in blocks handed out and not yet freed, block headers and rounding included
+        size_t bytesAllocated() const {
+            return inUse;
+        }
+        // the share of memory held by free blocks too small to give back to the OS, which only
+        // moving what is around them can put together again
+        double fragmentation() const {
+            return stranded == 0 ? 0.0 : double(stranded) / double(inUse + stranded);
+        }
+        // asks for the arena to be backed by huge pages, false if the kernel won't
+        bool useHugePages();
+        struct PageUsage {
+            size_t resident = 0;
+            size_t huge = 0;  // the part of resident that is on huge pages
+        };
+        PageUsage pageUsage() const;
+        // the start of the block of blockSize bytes that data is in, data must be inside such a block
+        std::byte* blockContaining(const void* data, size_t blockSize) const;
+        // how far data is into the arena, past the end if it is somewhere else
+        size_t offsetOf(const void* data) const;
 
     private:
         void addToFreePool(size_t poolIndex, std::byte* memory);
         std::byte* popBlockFromPool(size_t poolIndex);
         std::byte* getBuddy(size_t poolIndex, std::byte* memory) const;
         bool isInFreeList(std::byte* block, size_t poolIndex) const;
+        void setInFreeList(std::byte* block, size_t poolIndex, bool free);
         bool isFree(std::byte* block) const;
-        void removeBlockFromPool(std::byte* block);
+        void removeBlockFromPool(std::byte* block, size_t poolIndex);
         void verifyNotFreed(std::byte* block) const;
         void verifyFreed(std::byte* block) const;
         void verifyAllocatedBlockHasValidPoolSize(std::byte* block) const;
-        std::byte* growBlock(std::byte* block, size_t poolIndex, size_t newSize);
-        std::byte* shrinkBlock(std::byte* block, size_t poolIndex, size_t newSize);
-        bool isRequestedSizeAlreadyInCorrectPool(uint32_t poolIndex, size_t newSize) const;
-        void shrinkBlockToRequestedSize(size_t poolIndex, std::byte* block, size_t newSize);
+        void markAllocated(std::byte* block, size_t poolIndex, size_t header);
+        std::byte* blockOf(void* data) const;
+        std::byte* lowestFreeBlock(size_t poolIndex, size_t limit);
+        std::byte* growBlock(std::byte* block, size_t poolIndex, size_t newSize, size_t header);
+        std::byte* shrinkBlock(std::byte* block, size_t poolIndex, size_t newSize, size_t header);
+        bool addRegion();
+        void release(std::byte* block, size_t poolIndex);
+        uint32_t linkTo(const std::byte* block) const;
+        std::byte* linked(uint32_t link) const;
+        bool isRequestedSizeAlreadyInCorrectPool(uint32_t poolIndex, size_t newSize, size_t header) const;
+        void shrinkBlockToRequestedSize(size_t poolIndex, std::byte* block, size_t newSize, size_t header);
+        static constexpr size_t RELEASE_POOL = 17;  // free blocks of a megabyte and up give their pages back
+        static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+        // The heap can't grow past MAX_REGIONS gigabytes. Free list links are 32 bits in 8 byte units,
+        // with the top bit of the first one marking a block free, so 31 bits reach 16 GB and the
+        // sentinel has to fit past the last region. Going further would take 64 bit links, and so
+        // 16 byte blocks at the least
+        static constexpr size_t RESERVATION = MAX_REGIONS * REGION_SIZE + HUGE_PAGE_SIZE;
         Array<uint32_t, 28> pools;  // pools[0] is for 8 bytes, all the way up to pools[27] for 1 gig
+        uint32_t nonEmptyPools = 0;  // bit i is set when pools[i] has a free block
+        // per pool, how far into the arena there is known to be no free block
+        Array<size_t, 28> freeFrom;
+        // per region, a bit for every block of every pool, set while it is on the free list
+        Array<uint64_t*, MAX_REGIONS> freeBits;
+        std::byte* reservation = nullptr;
         std::byte* memory = nullptr;
+        size_t regions = 0;
+        bool hugePages = false;
+        size_t inUse = 0;
+        size_t stranded = 0;  // bytes in free blocks below RELEASE_POOL
     };
 
     extern Arena arena;
 
+    // Objects that tend to die young are bumped out of chunks taken from the arena, the chunk goes
+    // back once everything in it has been freed. Each object has a tag byte in front of it so
+    // Arena::deallocate can tell it apart from its own blocks and send it here, and its size before
+    // that. A chunk kept by a few survivors isn't left idle: it counts what is live on each of its
+    // lines, and once at most half of them are in use it is recycled, bumping through the runs of
+    // free lines between the survivors
+    class Nursery {
+    public:
+        static constexpr uint8_t TAG = 64;  // a pool index is below 28, a free block is 128 or above
+        static constexpr size_t CHUNK_SIZE = 64 * 1024;
+        static constexpr size_t MAX_OBJECT = 1024;  // bigger than this goes straight to the arena
+        static constexpr size_t LINE_SIZE = 256;
+        static constexpr size_t LINES = CHUNK_SIZE / LINE_SIZE;
+
+        void* allocate(size_t size, size_t alignment = Arena::MIN_ALIGNMENT);
+        void deallocate(void* data);
+        // bytes handed out since the collector last looked
+        size_t bytesAllocated() const {
+            return allocated;
+        }
+        void resetAllocated() {
+            allocated = 0;
+        }
+
+    private:
+        static constexpr size_t HEADER = 4;  // the size, then the tag right before the object
+
+        // only the thread whose nursery made a chunk touches it, so nothing in it is atomic
+        struct Chunk {
+            Nursery* owner = nullptr;
+            Chunk* previous = nullptr;  // the recyclable chunks are linked together
+            Chunk* next = nullptr;
+            size_t live = 0;
+            size_t usedLines = 0;
+            std::byte* top = nullptr;  // the run of free lines being bumped through
+            std::byte* end = nullptr;
+            bool recyclable = false;
+            Array<uint8_t, LINES> lines;  // how many objects are on each line
+        };
+        // the lines the chunk header is on are never handed out
+        static constexpr size_t FIRST_LINE = (Arena::MIN_ALIGNMENT + sizeof(Chunk) + LINE_SIZE - 1) / LINE_SIZE;
+        static constexpr size_t RECYCLE_AT = (LINES - FIRST_LINE) / 2;
+        // fits on any free line, with its header and alignment
+        static constexpr size_t MAX_RECYCLED_OBJECT = LINE_SIZE - 8;
+
+        static std::byte* blockOf(const Chunk* chunk);
+        static std::byte* fits(const Chunk* chunk, size_t size);
+        static bool nextHole(Chunk* chunk);
+        static void countLines(Chunk* chunk, const std::byte* object, size_t size);
+        Chunk* newChunk();
+        void retire(Chunk* chunk);
+        Chunk* takeRecyclable();
+        void link(Chunk* chunk);
+        void unlink(Chunk* chunk);
+        Chunk* current = nullptr;
+        Chunk* recyclable = nullptr;
+        size_t allocated = 0;
+    };
+
+    // every thread bumps its own objects, which stay on that thread
+    extern thread_local constinit Nursery nursery;
+
+    // Small blocks are cut from slabs that each hold one size class and are whole arena blocks
+    // themselves. There is no header in front of a small block, the arena knows a slab by its address
+    class Slabs {
+    public:
+        static constexpr size_t SIZES[] = {16, 24, 32, 48, 64, 96, 128};
+        static constexpr size_t CLASSES = std::size(SIZES);
+        static constexpr size_t MAX_SIZE = SIZES[CLASSES - 1];
+        static constexpr size_t SLAB_SIZE = 16 * 1024;
+        static constexpr size_t ALIGNMENT = 8;  // what every size class can promise
+
+        void* allocate(size_t size);
+        void deallocate(void* data);
+        bool owns(const void* data) const;
+        static size_t classOf(size_t size);
+        size_t classOf(const void* data) const;
+
+    private:
+        struct Slab {
+            Slab* previous = nullptr;  // the slabs of a size class with room left are linked together
+            Slab* next = nullptr;
+            void* free = nullptr;  // each freed block holds the next one
+            std::byte* top = nullptr;  // never handed out from here on
+            std::byte* end = nullptr;
+            size_t sizeClass = 0;
+            size_t live = 0;  // only changed with the heap lock held
+
+            bool full() const {
+                return !free && top + SIZES[sizeClass] > end;
+            }
+        };
+        static constexpr size_t HEADER = 64;  // the arena's header and the Slab, blocks start after it
+        static_assert(Arena::MIN_ALIGNMENT + sizeof(Slab) <= HEADER);
+
+        Slab* slabOf(const void* data) const;
+        Slab* newSlab(size_t sizeClass);
+        void link(Slab* slab);
+        void unlink(Slab* slab);
+        void setOwned(const Slab* slab, bool owned);
+
+        Array<Slab*, CLASSES> available;
+        // a bit for every place in the arena a slab could be, read without the heap lock
+        Array<std::atomic<uint64_t>, MAX_REGIONS * REGION_SIZE / SLAB_SIZE / 64> owned;
+    };
+
+    extern Slabs slabs;
+
+    // The way into the heap for everything else, from any thread. Small blocks come out of a cache
+    // each thread keeps, which goes to the slabs a batch at a time, anything else locks the arena
+
+    // size bytes starting at a multiple of alignment, which is a power of two up to Arena::MAX_ALIGNMENT
+    [[nodiscard]] void* allocateAligned(size_t size, size_t alignment);
+    [[nodiscard]] void* reallocateBytes(void* data, size_t newSize);
+    void deallocateBytes(void* data);
+    // an arena block moved lower down if there is room, small and nursery blocks stay where they are
+    [[nodiscard]] void* relocateBytes(void* data);
+
+    // The bytes one VM may have allocated at a time. Whatever is allocated while a budget is the
+    // thread's current one is charged to it. Going over the limit can't fail in the middle of an
+    // allocation, as garbage the collector hasn't found yet is still charged, so the budget is
+    // overdrawn instead, up to one limit over, and the VM collects at its next safepoint. Only if
+    // that doesn't bring it back under does it fail, with an error the VM reports like any other.
+    // Frees are credited to whichever budget is current then, so objects that outlive a VM or move
+    // between VMs make the count approximate
+    class MemoryBudget {
+    public:
+        void charge(size_t bytes) {
+            if (bytes > limit - std::min(used, limit) && !lenient) {
+                makeRoom(bytes);
+            }
+            used += bytes;
+            peak = std::max(peak, used);
+        }
+        void credit(size_t bytes) {
+            used -= std::min(bytes, used);
+        }
+
+        // counted but never refused while one is around, for work that can't stop halfway
+        class Lenience {
+        public:
+            explicit Lenience(MemoryBudget& budget) : budget(budget), was(std::exchange(budget.lenient, true)) {}
+            ~Lenience() {
+                budget.lenient = was;
+            }
+            Lenience(const Lenience&) = delete;
+            Lenience& operator=(const Lenience&) = delete;
+
+        private:
+            MemoryBudget& budget;
+            bool was;
+        };
+
+        // an overdraft the collection didn't pay back fails here, where the VM can stop cleanly
+        void settle();
+
+        size_t limit = SIZE_MAX;
+        size_t used = 0;
+        size_t peak = 0;
+        bool lenient = false;
+        bool overdrawn = false;  // let over the limit until the VM has collected
+
+    private:
+        void makeRoom(size_t bytes);
+    };
+
+    extern thread_local constinit MemoryBudget* currentBudget;
+
+    // makes a budget the current one until it goes out of scope
+    class BudgetScope {
+    public:
+        explicit BudgetScope(MemoryBudget* budget) : previous(std::exchange(currentBudget, budget)) {}
+        ~BudgetScope() {
+            currentBudget = previous;
+        }
+        BudgetScope(const BudgetScope&) = delete;
+        BudgetScope& operator=(const BudgetScope&) = delete;
+
+    private:
+        MemoryBudget* previous;
+    };
+
+    inline void chargeBudget(size_t bytes) {
+        if (currentBudget) {
+            currentBudget->charge(bytes);
+        }
+    }
+
+    inline void creditBudget(size_t bytes) {
+        if (currentBudget) {
+            currentBudget->credit(bytes);
+        }
+    }
+
+    // An object whose last reference goes while another is being destroyed waits here rather than
+    // being destroyed inside it, so freeing a long chain of objects is a loop instead of a
+    // recursion as deep as the chain. Whatever started the freeing works through the queue after,
+    // up to the budget when there is one, and the VM frees the rest a budget at a time between
+    // instructions
+    class FreeQueue {
+    public:
+        using Destroy = void (*)(void* block);
+
+        bool freeing() const {
+            return active;
+        }
+        void defer(void* block, Destroy destroy) {
+            queue.push_back(Deferred{block, destroy});
+        }
+        void startFreeing() {
+            active = true;
+        }
+        void finishFreeing() {
+            if (!queue.empty()) {
+                drain(budget);
+            }
+            active = false;
+        }
+        bool pending() const {
+            return !queue.empty() && !active;
+        }
+        // frees up to count of the waiting objects, and what freeing those lets go of
+        void drain(size_t count);
+
+        size_t budget = SIZE_MAX;  // objects freed in one go
+
+    private:
+        struct Deferred {
+            void* block;
+            Destroy destroy;
+        };
+        // kept with the standard allocator, freeing must not fail for want of memory budget
+        std::vector<Deferred> queue;
+        bool active = false;
+    };
+
+    extern thread_local constinit FreeQueue freeQueue;
+
     template <typename T>
     [[nodiscard]] T* reallocate(T* pointer, size_t oldSize, size_t newSize) {
         T* result = nullptr;
-        if (pointer == nullptr || (oldSize == 0 && newSize != 0)) {
-            result = reinterpret_cast<T*>(arena.allocate(newSize));
-        } else if (newSize == 0 && oldSize != 0) {
-            arena.deallocate(pointer);
-            return nullptr;
-        } else if (newSize != 0 && oldSize != 0) {
-            result = reinterpret_cast<T*>(arena.reallocate(pointer, newSize));
-        }
-        if (!result)
-            throw BadAllocException{"Memory realloc failed", std::bad_alloc{}};
+        size_t charged = 0;
+        try {
+            if (pointer == nullptr || (oldSize == 0 && newSize != 0)) {
+                chargeBudget(newSize);
+                charged = newSize;
+                result = reinterpret_cast<T*>(allocateAligned(newSize, alignof(T)));
+            } else if (newSize == 0 && oldSize != 0) {
+                deallocateBytes(pointer);
+                creditBudget(oldSize);
+                profiler.resized<T[]>(oldSize, 0);
+                return nullptr;
+            } else if (newSize != 0 && oldSize != 0) {
+                if (newSize > oldSize) {
+                    chargeBudget(newSize - oldSize);
+                    charged = newSize - oldSize;
+                }
+                result = reinterpret_cast<T*>(reallocateBytes(pointer, newSize));
+            }
+            if (!result)
+                throw BadAllocException{"Memory realloc failed", std::bad_alloc{}};
+        } catch (...) {
+            // a failed allocation gives back what it was charged, or the budget shrinks with every one
+            creditBudget(charged);
+            throw;
+        }
+        auto previousSize = pointer == nullptr ? 0 : oldSize;
+        if (newSize < previousSize) {
+            creditBudget(previousSize - newSize);
+        }
+        profiler.resized<T[]>(previousSize, newSize);
         return result;
     }
 
@@ -64,8 +385,8 @@ namespace lox {
 
     template <typename T>
     void deallocate(T* p) {
-        // just put a 1 in the old size to force a deallocation
-        std::ignore = reallocate(p, 1, 0);
+        // allocate<T>() took sizeof(T), which is also what the profiler has down for it
+        std::ignore = reallocate(p, sizeof(T), 0);
     }
 
     template <typename T>
@@ -108,10 +429,19 @@ namespace lox {
     template <typename T>
     class SharedPtr {
     public:
+        using element_type = T;
         SharedPtr() {}
         SharedPtr(T* inPtr) {
-            ctrlBlock = allocate<ControlBlock>();
+            chargeBudget(sizeof(ControlBlock));
+            try {
+                ctrlBlock = allocateBlock<ControlBlock>();
+            } catch (...) {
+                creditBudget(sizeof(ControlBlock));
+                throw;
+            }
+            profiler.allocated<ControlBlock>(sizeof(ControlBlock));
             std::construct_at(ctrlBlock, inPtr);
+            countReferences();
         }
 
         SharedPtr(const SharedPtr& sp) {
@@ -168,30 +498,119 @@ namespace lox {
             }
         }
 
+        // the object goes right behind its control block in one allocation, only an adopted pointer needs two
         template <typename... Args>
         static SharedPtr<T> Make(Args&&... args) {
-            T* ptr = allocate<T>();
-            std::construct_at(ptr, std::forward<Args>(args)...);
-            return SharedPtr(ptr);
+            chargeBudget(INLINE_OFFSET + sizeof(T));
+            std::byte* memory = nullptr;
+            T* ptr = nullptr;
+            try {
+                memory = allocateBlock<std::byte>(INLINE_OFFSET + sizeof(T), std::max(alignof(ControlBlock), alignof(T)));
+                ptr = std::construct_at(reinterpret_cast<T*>(memory + INLINE_OFFSET), std::forward<Args>(args)...);
+            } catch (...) {
+                // running out of memory or budget while T is built leaves nothing behind
+                if (memory) {
+                    deallocateBytes(memory);
+                }
+                creditBudget(INLINE_OFFSET + sizeof(T));
+                throw;
+            }
+            profiler.allocated<T>(INLINE_OFFSET + sizeof(T));
+            SharedPtr<T> sp;
+            sp.ctrlBlock = std::construct_at(reinterpret_cast<ControlBlock*>(memory), ptr);
+            sp.countReferences();
+            return sp;
+        }
+
+        // lets a reference be held as an opaque handle (the NaN-boxed value does this) and taken back later
+        void* release() {
+            return std::exchange(ctrlBlock, nullptr);
+        }
+        static SharedPtr<T> adopt(void* handle) {
+            SharedPtr<T> sp;
+            sp.ctrlBlock = static_cast<ControlBlock*>(handle);
+            return sp;
+        }
+        static void retain(void* handle) {
+            static_cast<ControlBlock*>(handle)->incrementRef();
+        }
+        // the handle without giving up the reference, for something that must not keep the object alive
+        void* handle() const {
+            return ctrlBlock;
+        }
+        static T* get(void* handle) {
+            return static_cast<ControlBlock*>(handle)->get();
         }
 
     private:
+        // the collector's objects and their control blocks start out in the nursery
+        template <typename U>
+        static U* allocateBlock(size_t size = sizeof(U), size_t alignment = alignof(U)) {
+            if constexpr (std::is_base_of_v<Traced, T>) {
+                return static_cast<U*>(nursery.allocate(size, alignment));
+            } else {
+                return static_cast<U*>(allocateAligned(size, alignment));
+            }
+        }
+
+        void countReferences() {
+            if constexpr (std::is_base_of_v<Traced, T>) {
+                if (T* ptr = ctrlBlock->get()) {
+                    ptr->references = ctrlBlock->count();
+                }
+            }
+        }
+
         class ControlBlock {
         private:
-            std::atomic<size_t> refCount = 0;
+            RefCount refCount = 0;
             T* rawPtr = nullptr;
 
         public:
             ControlBlock(T* rawPtr) : refCount(1), rawPtr(rawPtr) {
             }
             void decrementRef() {
-                if (refCount.fetch_sub(1) == 1) {
+                if (--refCount == 0) {
+                    if (freeQueue.freeing()) {
+                        // it can't be handed out by a weak reference while it waits
+                        if constexpr (std::is_base_of_v<Traced, T>) {
+                            if (rawPtr) {
+                                rawPtr->expireWeakRef();
+                            }
+                        }
+                        freeQueue.defer(this, &destroyBlock);
+                        return;
+                    }
+                    freeQueue.startFreeing();
+                    destroy();
+                    freeQueue.finishFreeing();
+                } else if constexpr (std::is_base_of_v<Traced, T>) {
                     if (rawPtr) {
-                        std::destroy_at(rawPtr);
+                        rawPtr->released();
+                    }
+                }
+            }
+
+            static void destroyBlock(void* block) {
+                static_cast<ControlBlock*>(block)->destroy();
+            }
+
+            void destroy() {
+                bool inlined = holdsInline();
+                if (rawPtr) {
+                    std::destroy_at(rawPtr);
+                    if (!inlined) {
                         deallocate(rawPtr);
                     }
-                    deallocate<ControlBlock>(this);
                 }
+                if (inlined) {
+                    creditBudget(INLINE_OFFSET + sizeof(T));
+                    profiler.freed<T>(INLINE_OFFSET + sizeof(T));
+                } else {
+                    creditBudget(sizeof(ControlBlock));
+                    profiler.freed<ControlBlock>(sizeof(ControlBlock));
+                }
+                deallocateBytes(this);
             }
 
             void incrementRef() {
@@ -201,7 +620,17 @@ namespace lox {
             T* get() const {
                 return rawPtr;
             }
+
+            const RefCount* count() const {
+                return &refCount;
+            }
+
+            // made by Make, so the object lives in the same allocation
+            bool holdsInline() const {
+                return static_cast<void*>(rawPtr) == reinterpret_cast<const std::byte*>(this) + INLINE_OFFSET;
+            }
         };
+        static constexpr size_t INLINE_OFFSET = (sizeof(ControlBlock) + alignof(T) - 1) / alignof(T) * alignof(T);
         ControlBlock* ctrlBlock = nullptr;
     };
 
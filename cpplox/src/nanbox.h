@@ -0,0 +1,282 @@
+#ifndef CPPLOX_NANBOX_H_
+#define CPPLOX_NANBOX_H_
+
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+
+#include "interned.h"
+#include "loxexception.h"
+#include "memory.h"
+
+// A value packed in 64 bits. Numbers are stored as the double itself, everything else lives in the
+// payload of a quiet NaN next to a tag saying what it is. Objects are the control block of their
+// SharedPtr, so a copy is the bits plus a reference count bump and the object is shared as before.
+// A string is the interned object, so two strings are equal exactly when their bits are
+namespace lox {
+    class NativeFunction;
+    class Function;
+    class Closure;
+    struct UpValueObj;
+    class Class;
+    class Instance;
+    class BoundMethod;
+    class WeakRef;
+    class WeakMap;
+
+    class Value {
+    public:
+        enum class Tag : uint8_t {
+            Number,  // not boxed, any other tag is
+            Nil,
+            Bool,
+            String,
+            Function,
+            NativeFunction,
+            Closure,
+            UpValue,
+            Class,
+            Instance,
+            BoundMethod,
+            WeakRef,
+            WeakMap
+        };
+
+        Value() : Value(nullptr) {}
+        Value(std::nullptr_t) : bits(NIL) {}
+        Value(bool b) : bits(box(Tag::Bool, uint64_t{b})) {}
+        // every NaN becomes the one NaN that can't be mistaken for a boxed value
+        Value(double d) : bits(std::isnan(d) ? CANONICAL_NAN : std::bit_cast<uint64_t>(d)) {}
+        Value(InternedString s) : bits(box(Tag::String, s.shared().release())) {}
+        Value(String s) : Value(InternedString(std::move(s))) {}
+        Value(StringView s) : Value(InternedString(s)) {}
+        Value(const char*) = delete;
+        template <typename T>
+        Value(SharedPtr<T> object) : bits(box(tagOf<SharedPtr<T>>(), object.release())) {}
+
+        Value(const Value& rhs) : bits(rhs.bits) {
+            retain();
+        }
+        Value(Value&& rhs) : bits(std::exchange(rhs.bits, NIL)) {}
+        Value& operator=(const Value& rhs) {
+            if (this != &rhs) {
+                rhs.retain();
+                drop();
+                bits = rhs.bits;
+            }
+            return *this;
+        }
+        Value& operator=(Value&& rhs) {
+            if (this != &rhs) {
+                drop();
+                bits = std::exchange(rhs.bits, NIL);
+            }
+            return *this;
+        }
+        ~Value() {
+            drop();
+        }
+
+        Tag tag() const {
+            return (bits & (SIGN | QNAN)) == QNAN ? Tag((bits & TAG_MASK) >> TAG_SHIFT) : Tag::Number;
+        }
+
+        template <typename T>
+        bool is() const {
+            return tag() == tagOf<T>();
+        }
+
+        template <typename T>
+        T as() const {
+            if (!is<T>()) {
+                throw Exception("Value holds a different type", nullptr);
+            }
+            if constexpr (std::is_same_v<T, double>) {
+                return std::bit_cast<double>(bits);
+            } else if constexpr (std::is_same_v<T, bool>) {
+                return payload() != 0;
+            } else if constexpr (std::is_same_v<T, std::nullptr_t>) {
+                return nullptr;
+            } else if constexpr (std::is_same_v<T, InternedString>) {
+                return InternedString(share<String>());
+            } else {
+                return share<typename T::element_type>();
+            }
+        }
+
+        template <typename T>
+        T* borrow() const {
+            if (!is<SharedPtr<T>>()) {
+                throw Exception("Value holds a different type", nullptr);
+            }
+            return SharedPtr<T>::get(handle());
+        }
+
+        friend bool operator==(const Value& lhs, const Value& rhs) {
+            auto tag = lhs.tag();
+            if (tag != rhs.tag()) {
+                return false;
+            }
+            if (tag == Tag::Number) {
+                return lhs.as<double>() == rhs.as<double>();
+            }
+            return lhs.bits == rhs.bits;
+        }
+
+    private:
+        static constexpr uint64_t SIGN = 0x8000000000000000;
+        static constexpr uint64_t QNAN = 0x7ff8000000000000;
+        static constexpr uint64_t CANONICAL_NAN = QNAN;
+        static constexpr uint64_t TAG_SHIFT = 47;
+        static constexpr uint64_t TAG_MASK = uint64_t{0xF} << TAG_SHIFT;
+        static constexpr uint64_t PAYLOAD_MASK = (uint64_t{1} << TAG_SHIFT) - 1;  // user space pointers fit in 47 bits
+        static constexpr uint64_t NIL = QNAN | (uint64_t{std::to_underlying(Tag::Nil)} << TAG_SHIFT);
+
+        static uint64_t box(Tag tag, uint64_t payload) {
+            return QNAN | (uint64_t{std::to_underlying(tag)} << TAG_SHIFT) | payload;
+        }
+        static uint64_t box(Tag tag, void* handle) {
+            auto payload = std::bit_cast<uint64_t>(handle);
+            if (payload & ~PAYLOAD_MASK) {
+                throw Exception("Object address does not fit in a boxed value", nullptr);
+            }
+            return box(tag, payload);
+        }
+
+        template <typename T>
+        static constexpr Tag tagOf() {
+            if constexpr (std::is_same_v<T, double>) {
+                return Tag::Number;
+            } else if constexpr (std::is_same_v<T, std::nullptr_t>) {
+                return Tag::Nil;
+            } else if constexpr (std::is_same_v<T, bool>) {
+                return Tag::Bool;
+            } else if constexpr (std::is_same_v<T, InternedString>) {
+                return Tag::String;
+            } else if constexpr (std::is_same_v<T, SharedPtr<lox::Function>>) {
+                return Tag::Function;
+            } else if constexpr (std::is_same_v<T, SharedPtr<lox::NativeFunction>>) {
+                return Tag::NativeFunction;
+            } else if constexpr (std::is_same_v<T, SharedPtr<lox::Closure>>) {
+                return Tag::Closure;
+            } else if constexpr (std::is_same_v<T, SharedPtr<lox::UpValueObj>>) {
+                return Tag::UpValue;
+            } else if constexpr (std::is_same_v<T, SharedPtr<lox::Class>>) {
+                return Tag::Class;
+            } else if constexpr (std::is_same_v<T, SharedPtr<lox::Instance>>) {
+                return Tag::Instance;
+            } else if constexpr (std::is_same_v<T, SharedPtr<lox::BoundMethod>>) {
+                return Tag::BoundMethod;
+            } else if constexpr (std::is_same_v<T, SharedPtr<lox::WeakRef>>) {
+                return Tag::WeakRef;
+            } else {
+                static_assert(std::is_same_v<T, SharedPtr<lox::WeakMap>>, "not a type a value can hold");
+                return Tag::WeakMap;
+            }
+        }
+
+        uint64_t payload() const {
+            return bits & PAYLOAD_MASK;
+        }
+        void* handle() const {
+            return std::bit_cast<void*>(payload());
+        }
+        bool isObject() const {
+            return tag() >= Tag::String;
+        }
+
+        template <typename T>
+        SharedPtr<T> share() const {
+            SharedPtr<T>::retain(handle());
+            return SharedPtr<T>::adopt(handle());
+        }
+
+        void retain() const {
+            switch (tag()) {
+            case Tag::String:
+                return SharedPtr<String>::retain(handle());
+            case Tag::Function:
+                return SharedPtr<lox::Function>::retain(handle());
+            case Tag::NativeFunction:
+                return SharedPtr<lox::NativeFunction>::retain(handle());
+            case Tag::Closure:
+                return SharedPtr<lox::Closure>::retain(handle());
+            case Tag::UpValue:
+                return SharedPtr<lox::UpValueObj>::retain(handle());
+            case Tag::Class:
+                return SharedPtr<lox::Class>::retain(handle());
+            case Tag::Instance:
+                return SharedPtr<lox::Instance>::retain(handle());
+            case Tag::BoundMethod:
+                return SharedPtr<lox::BoundMethod>::retain(handle());
+            case Tag::WeakRef:
+                return SharedPtr<lox::WeakRef>::retain(handle());
+            case Tag::WeakMap:
+                return SharedPtr<lox::WeakMap>::retain(handle());
+            default:
+                return;
+            }
+        }
+
+        void drop() {
+            if (isObject()) {
+                release();
+            }
+        }
+        // the object types are only complete in object.cpp, so letting go of one happens there
+        void release();
+
+        uint64_t bits;
+    };
+    static_assert(sizeof(Value) == sizeof(uint64_t));
+
+    template <typename T>
+    bool is(const Value& value) {
+        return value.is<T>();
+    }
+
+    template <typename T>
+    T as(const Value& value) {
+        return value.as<T>();
+    }
+
+    template <typename T>
+    T* borrow(const Value& value) {
+        return value.borrow<T>();
+    }
+
+    template <typename F>
+    decltype(auto) visit(F&& f, const Value& value) {
+        switch (value.tag()) {
+        case Value::Tag::Number:
+            return f(value.as<double>());
+        case Value::Tag::Nil:
+            return f(nullptr);
+        case Value::Tag::Bool:
+            return f(value.as<bool>());
+        case Value::Tag::String:
+            return f(value.as<InternedString>());
+        case Value::Tag::Function:
+            return f(value.as<SharedPtr<Function>>());
+        case Value::Tag::NativeFunction:
+            return f(value.as<SharedPtr<NativeFunction>>());
+        case Value::Tag::Closure:
+            return f(value.as<SharedPtr<Closure>>());
+        case Value::Tag::UpValue:
+            return f(value.as<SharedPtr<UpValueObj>>());
+        case Value::Tag::Class:
+            return f(value.as<SharedPtr<Class>>());
+        case Value::Tag::Instance:
+            return f(value.as<SharedPtr<Instance>>());
+        case Value::Tag::BoundMethod:
+            return f(value.as<SharedPtr<BoundMethod>>());
+        case Value::Tag::WeakRef:
+            return f(value.as<SharedPtr<WeakRef>>());
+        case Value::Tag::WeakMap:
+            return f(value.as<SharedPtr<WeakMap>>());
+        }
+        std::unreachable();
+    }
+}
+#endif
@@ -0,0 +1,61 @@
+#ifndef CPPLOX_NATIVE_H_
+#define CPPLOX_NATIVE_H_
+
+#include <type_traits>
+#include <utility>
+
+#include "value.h"
+
+// Adapts a plain C++ function with typed parameters to the NativeFunction calling convention.
+// The arity and the argument checks are generated at compile time from the signature, so a native
+// only ever sees arguments of the type it asked for, borrowed straight from the VM stack
+namespace lox {
+    template <typename T>
+    struct NativeArgument;
+
+    template <>
+    struct NativeArgument<Value> {
+        static bool matches(const Value&) { return true; }
+        static const Value& get(const Value& v) { return v; }
+    };
+
+    template <>
+    struct NativeArgument<double> {
+        static bool matches(const Value& v) { return isNumber(v); }
+        static double get(const Value& v) { return as<double>(v); }
+    };
+
+    template <>
+    struct NativeArgument<InternedString> {
+        static bool matches(const Value& v) { return isString(v); }
+        static decltype(auto) get(const Value& v) { return as<InternedString>(v); }
+    };
+
+    template <typename T>
+    struct NativeArgument<SharedPtr<T>> {
+        static bool matches(const Value& v) { return is<SharedPtr<T>>(v); }
+        static decltype(auto) get(const Value& v) { return as<SharedPtr<T>>(v); }
+    };
+
+    template <auto F>
+    struct Native;
+
+    template <typename... Args, NativeFunction::Result (*F)(Args...)>
+    struct Native<F> {
+        static constexpr size_t arity = sizeof...(Args);
+
+        static NativeFunction::Result call(Span<Value> values) {
+            return unpack(values.begin(), std::index_sequence_for<Args...>{});
+        }
+
+    private:
+        template <size_t... I>
+        static NativeFunction::Result unpack([[maybe_unused]] const Value* args, std::index_sequence<I...>) {
+            if (!(NativeArgument<std::remove_cvref_t<Args>>::matches(args[I]) && ...)) {
+                return NativeError::WrongArgumentType;
+            }
+            return F(NativeArgument<std::remove_cvref_t<Args>>::get(args[I])...);
+        }
+    };
+}
+#endif
@@ -1,11 +1,14 @@
 #include "object.h"
 
+#include <utility>
+
 #include "algorithm.h"
 #include "chunk.h"
+#include "collector.h"
 namespace lox {
     Function::Function(StringView name) : name(name), chunk(SharedPtr<Chunk>::Make()) {}
     Function::~Function() {}
-    SharedPtr<Chunk> Function::getChunk() const {
+    const SharedPtr<Chunk>& Function::getChunk() const {
         return chunk;
     }
     StringView Function::getName() const {
@@ -37,15 +40,15 @@ namespace lox {
     }
 
     Optional<size_t> Function::getUpvalue(size_t index, bool isLocal) {
-        for (const auto& [i, item] : views::enumerate(upvalues)) {
-            if (item.index == index && item.isLocal == isLocal) {
+        for (size_t i = 0; i < upvalues.size(); ++i) {
+            if (upvalues[i].index == index && upvalues[i].isLocal == isLocal) {
                 return i;
             }
         }
         return {};
     }
 
-    const Vector<Function::UpValue>& Function::getUpvalues() const {
+    const Function::UpValues& Function::getUpvalues() const {
         return upvalues;
     }
 
@@ -53,32 +56,61 @@ namespace lox {
         return upvalues.size();
     }
 
+    void Function::setFieldGetter(InternedString field) {
+        fieldGetter = field;
+    }
+
+    Optional<InternedString> Function::getFieldGetter() const {
+        return fieldGetter;
+    }
+
+    const char* toMessage(NativeError error) {
+        switch (error) {
+        case NativeError::WrongArgumentCount:
+            return "Wrong number of arguments";
+        case NativeError::WrongArgumentType:
+            return "Wrong argument type passed to native function";
+        case NativeError::InvalidRange:
+            return "Second number must be bigger than first number";
+        }
+        std::unreachable();
+    }
+
     NativeFunction::NativeFunction(Func f, size_t argCount) : function(f), argCount(argCount) {}
 
-    Expected<Value, String> NativeFunction::invoke(size_t args, Span<Value> values) {
-        if (args != this->argCount) {
-            return String{"Wrong number of arguments"};
+    NativeFunction::Result NativeFunction::invoke(Span<Value> values) const {
+        if (values.size() != this->argCount) {
+            return NativeError::WrongArgumentCount;
         }
         return function(values);
     }
 
     Closure::Closure(SharedPtr<Function> f) : f(f) {}
-    SharedPtr<Function> Closure::getFunction() const { return f; }
+    const SharedPtr<Function>& Closure::getFunction() const { return f; }
     void Closure::addUpValue(SharedPtr<UpValueObj> obj) {
-        upvalues.push_back(obj);
+        upvalues.push_back(std::move(obj));
     }
 
-    SharedPtr<UpValueObj> Closure::getUpValue(size_t index) const {
+    const SharedPtr<UpValueObj>& Closure::getUpValue(size_t index) const {
         return upvalues[index];
     }
+    size_t Closure::heapSize() const {
+        return sizeof(Closure) + upvalues.allocatedBytes();
+    }
+
     void Closure::setUpValue(size_t index, Value value) {
-        *(upvalues[index]->location) = value;
+        auto& upvalue = upvalues[index];
+        *(upvalue->location) = std::move(value);
+        if (upvalue->isClosed()) {
+            upvalue->written();
+        }
     }
 
     Class::Class(InternedString name) : name(name) {}
     StringView Class::getName() const { return name.string(); }
     void Class::setMethod(InternedString name, Value v) {
-        methods.insert(name, v);
+        methods.insert(std::move(name), std::move(v));
+        written();
     }
 
     Optional<Value> Class::getMethod(InternedString name) const {
@@ -89,26 +121,36 @@ namespace lox {
     }
 
     void Class::setInitializer(Value v) {
-        initializer = v;
+        initializer = std::move(v);
+        written();
     }
 
     Optional<Value> Class::getInitializer() const {
         return initializer;
     }
 
+    size_t Class::heapSize() const {
+        return sizeof(Class) + methods.bytes();
+    }
+
     void Class::inherit(const Class& super) {
         methods.insert(super.methods);
+        written();
     }
 
     Instance::Instance(SharedPtr<Class> cls) : cls(cls) {}
     StringView Instance::getName() const { return cls->getName(); }
+    size_t Instance::heapSize() const {
+        return sizeof(Instance) + fields.bytes();
+    }
 
     Optional<Value> Instance::getField(InternedString name) const {
         return fields.get(name);
     }
 
     void Instance::setField(InternedString name, Value v) {
-        fields.insert(name, v);
+        fields.insert(std::move(name), std::move(v));
+        written();
     }
 
     bool Instance::hasField(InternedString name) const {
@@ -130,4 +172,255 @@ namespace lox {
     Value BoundMethod::getReceiver() const {
         return receiver;
     }
+
+    // the key for an object in the table of weak references
+    struct ObjectKey {
+        const Traced* object;
+        size_t getHash() const {
+            auto bits = reinterpret_cast<uintptr_t>(object);
+            return (bits >> 4) ^ (bits >> 20);
+        }
+        friend bool operator==(const ObjectKey&, const ObjectKey&) = default;
+    };
+
+    // the WeakRef of every object that has one, which lives at least as long as the object
+    static auto& getWeakRefs() {
+        static Table<ObjectKey, SharedPtr<WeakRef>> refs;
+        return refs;
+    }
+
+    template <typename T>
+    concept TracedPointer = requires { typename T::element_type; } && std::is_base_of_v<Traced, typename T::element_type>;
+
+    template <typename T>
+    static Value reviveAs(void* handle) {
+        SharedPtr<T>::retain(handle);
+        return Value{SharedPtr<T>::adopt(handle)};
+    }
+
+    WeakRef::WeakRef(void* handle, Revive revive) : handle(handle), revive(revive) {}
+
+    SharedPtr<WeakRef> WeakRef::of(const Value& value) {
+        return lox::visit(
+            []<typename T>(const T& object) -> SharedPtr<WeakRef> {
+                if constexpr (TracedPointer<T>) {
+                    Traced* traced = *object;
+                    if (traced->weaklyHeld) {
+                        return getWeakRefs().get(ObjectKey{traced}).value();
+                    }
+                    auto ref = SharedPtr<WeakRef>::Make(object.handle(), &reviveAs<typename T::element_type>);
+                    getWeakRefs().insert(ObjectKey{traced}, ref);
+                    traced->weaklyHeld = true;
+                    return ref;
+                } else {
+                    return {};
+                }
+            },
+            value);
+    }
+
+    SharedPtr<WeakRef> WeakRef::find(const Value& value) {
+        return lox::visit(
+            []<typename T>(const T& object) -> SharedPtr<WeakRef> {
+                if constexpr (TracedPointer<T>) {
+                    if (object->weaklyHeld) {
+                        return getWeakRefs().get(ObjectKey{*object}).value();
+                    }
+                }
+                return {};
+            },
+            value);
+    }
+
+    void WeakRef::expire(const Traced* object) {
+        auto& refs = getWeakRefs();
+        if (auto ref = refs.get(ObjectKey{object})) {
+            ref.value()->handle = nullptr;
+            refs.erase(ObjectKey{object});
+        }
+    }
+
+    Value WeakRef::get() const {
+        return handle ? revive(handle) : Value{nullptr};
+    }
+
+    void Traced::forgetWeakRef() {
+        weaklyHeld = false;
+        WeakRef::expire(this);
+    }
+
+    size_t WeakMap::Key::getHash() const {
+        auto bits = reinterpret_cast<uintptr_t>(*ref);
+        return (bits >> 4) ^ (bits >> 20);
+    }
+
+    Optional<Value> WeakMap::get(const Value& key) const {
+        // an object that has never been held weakly can't be a key
+        auto ref = WeakRef::find(key);
+        if (!ref) {
+            return {};
+        }
+        return entries.get(Key{ref});
+    }
+
+    bool WeakMap::set(const Value& key, Value value) {
+        auto ref = WeakRef::of(key);
+        if (!ref) {
+            return false;
+        }
+        // each sweep is paid for by the entries added since the one before
+        if (++addedSinceSweep > sweepAt) {
+            sweep();
+        }
+        entries.insert(Key{ref}, std::move(value));
+        written();
+        return true;
+    }
+
+    bool WeakMap::erase(const Value& key) {
+        auto ref = WeakRef::find(key);
+        return ref && entries.erase(Key{ref});
+    }
+
+    void WeakMap::sweep() {
+        Vector<Key> expired;
+        size_t alive = 0;
+        entries.forEach([&expired, &alive](const Key& key, const Value&) {
+            if (key.ref->expired()) {
+                expired.push_back(key);
+            } else {
+                alive++;
+            }
+        });
+        for (const auto& key : expired) {
+            entries.erase(key);
+        }
+        addedSinceSweep = 0;
+        sweepAt = std::max(alive, MIN_SWEEP);
+    }
+
+    size_t WeakMap::heapSize() const {
+        return sizeof(WeakMap) + entries.bytes();
+    }
+
+    // the open upvalue's slot is on the stack, which is a root already
+    void UpValueObj::trace(Collector& collector) const {
+        collector.mark(closed);
+    }
+
+    void UpValueObj::clearReferences(Graveyard& graveyard) {
+        graveyard.bury(std::move(closed));
+    }
+
+    void Closure::trace(Collector& collector) const {
+        for (auto& upvalue : upvalues) {
+            collector.mark(upvalue);
+        }
+    }
+
+    void Closure::clearReferences(Graveyard& graveyard) {
+        for (auto& upvalue : upvalues) {
+            graveyard.bury(std::move(upvalue));
+        }
+        upvalues.clear();
+    }
+
+    void Closure::compactBuffers() {
+        upvalues.compact();
+    }
+
+    void Class::trace(Collector& collector) const {
+        methods.forEachValue([&collector](const Value& method) { collector.mark(method); });
+        if (initializer.hasValue()) {
+            collector.mark(initializer.value());
+        }
+    }
+
+    void Class::clearReferences(Graveyard& graveyard) {
+        methods.forEachValue([&graveyard](Value& method) { graveyard.bury(std::move(method)); });
+        if (initializer.hasValue()) {
+            graveyard.bury(std::move(initializer.value()));
+        }
+    }
+
+    void Class::compactBuffers() {
+        methods.compact();
+    }
+
+    void Instance::trace(Collector& collector) const {
+        collector.mark(cls);
+        fields.forEachValue([&collector](const Value& field) { collector.mark(field); });
+    }
+
+    void Instance::clearReferences(Graveyard& graveyard) {
+        graveyard.bury(std::move(cls));
+        fields.forEachValue([&graveyard](Value& field) { graveyard.bury(std::move(field)); });
+    }
+
+    void Instance::compactBuffers() {
+        fields.compact();
+    }
+
+    void BoundMethod::trace(Collector& collector) const {
+        collector.mark(receiver);
+        collector.mark(method);
+    }
+
+    void BoundMethod::clearReferences(Graveyard& graveyard) {
+        graveyard.bury(std::move(receiver));
+        graveyard.bury(std::move(method));
+    }
+
+    // only the values are held, including those of entries whose key has gone and a sweep hasn't taken
+    void WeakMap::trace(Collector& collector) const {
+        entries.forEachValue([&collector](const Value& value) { collector.mark(value); });
+    }
+
+    void WeakMap::clearReferences(Graveyard& graveyard) {
+        entries.forEachValue([&graveyard](Value& value) { graveyard.bury(std::move(value)); });
+    }
+
+    void WeakMap::compactBuffers() {
+        entries.compact();
+    }
+
+#ifdef LOX_NAN_BOXING
+    // adopting the handle back into a SharedPtr that dies straight away drops the reference
+    void Value::release() {
+        switch (tag()) {
+        case Tag::String:
+            SharedPtr<String>::adopt(handle());
+            break;
+        case Tag::Function:
+            SharedPtr<lox::Function>::adopt(handle());
+            break;
+        case Tag::NativeFunction:
+            SharedPtr<lox::NativeFunction>::adopt(handle());
+            break;
+        case Tag::Closure:
+            SharedPtr<lox::Closure>::adopt(handle());
+            break;
+        case Tag::UpValue:
+            SharedPtr<lox::UpValueObj>::adopt(handle());
+            break;
+        case Tag::Class:
+            SharedPtr<lox::Class>::adopt(handle());
+            break;
+        case Tag::Instance:
+            SharedPtr<lox::Instance>::adopt(handle());
+            break;
+        case Tag::BoundMethod:
+            SharedPtr<lox::BoundMethod>::adopt(handle());
+            break;
+        case Tag::WeakRef:
+            SharedPtr<lox::WeakRef>::adopt(handle());
+            break;
+        case Tag::WeakMap:
+            SharedPtr<lox::WeakMap>::adopt(handle());
+            break;
+        default:
+            break;
+        }
+    }
+#endif
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include <any>
 
+#include "interned.h"
 #include "memory.h"
 #include "stack.h"
 #include "string.h"
@@ -14,7 +15,7 @@ namespace lox {
         Function(StringView name);
         ~Function();
 
-        SharedPtr<Chunk> getChunk() const;
+        const SharedPtr<Chunk>& getChunk() const;
         StringView getName() const;
         uint8_t getArity() const;
 
@@ -32,13 +33,19 @@ namespace lox {
             bool isLocal = false;
             size_t index = 0;
         };
-        const Vector<UpValue>& getUpvalues() const;
+        using UpValues = SmallVector<UpValue, 4>;
+        const UpValues& getUpvalues() const;
+
+        // set by the compiler when the whole method body is `return this.<field>;`
+        void setFieldGetter(InternedString field);
+        Optional<InternedString> getFieldGetter() const;
 
     private:
         uint8_t arity = 0;
         StringView name;
         SharedPtr<Chunk> chunk;
-        Vector<UpValue> upvalues;
+        UpValues upvalues;
+        Optional<InternedString> fieldGetter;
     };
 
 }
@@ -0,0 +1,115 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <format>
+#include <ranges>
+#include <utility>
+#include <vector>
+
+namespace lox {
+    HeapProfiler profiler;
+
+    // the head of the list of types, constant initialised so types seen before main still get on it
+    static std::atomic<HeapProfiler::TypeStats*> allTypes = nullptr;
+
+    HeapProfiler::TypeStats::TypeStats(std::string_view name) : name(name), next(allTypes.load()) {
+        while (!allTypes.compare_exchange_weak(next, this)) {
+        }
+    }
+
+    HeapProfiler::WatchScope::WatchScope(const void* context, SiteLookup lookup) {
+        std::scoped_lock lock(profiler.sitesLock);
+        previousContext = std::exchange(profiler.context, context);
+        previousLookup = std::exchange(profiler.lookup, lookup);
+    }
+
+    HeapProfiler::WatchScope::~WatchScope() {
+        std::scoped_lock lock(profiler.sitesLock);
+        profiler.context = previousContext;
+        profiler.lookup = previousLookup;
+    }
+
+    void HeapProfiler::recordSite(size_t bytes) {
+        std::scoped_lock lock(sitesLock);
+        Site site = lookup ? lookup(context) : Site{};
+        auto& stats = sites[SiteKey{site.function, site.line}];
+        if (stats.allocations == 0) {
+            stats.name = site.function ? std::string(site.name) : "(outside Lox)";
+            stats.line = site.line;
+        }
+        stats.allocations++;
+        stats.bytes += bytes;
+    }
+
+    // the lox:: and std:: prefixes only make the names longer, and so do templates nested deeper than this
+    constexpr size_t MAX_DEPTH = 3;
+
+    static std::string shortName(std::string_view name) {
+        std::string result;
+        size_t depth = 0;
+        for (size_t index = 0; index < name.size();) {
+            auto rest = name.substr(index);
+            if (rest.starts_with("lox::") || rest.starts_with("std::")) {
+                index += 5;
+                continue;
+            }
+            char c = name[index++];
+            if (c == '>') {
+                depth--;
+            }
+            if (depth < MAX_DEPTH) {
+                result += c;
+            }
+            if (c == '<') {
+                if (depth == MAX_DEPTH - 1) {
+                    result += "...";
+                }
+                depth++;
+            }
+        }
+        return result;
+    }
+
+    std::string HeapProfiler::report() const {
+        if (!counting) {
+            return "Allocations are only counted with --heap-report\n";
+        }
+        std::vector<const TypeStats*> types;
+        for (auto type = allTypes.load(); type; type = type->next) {
+            if (type->allocations.load(std::memory_order_relaxed) > 0) {
+                types.push_back(type);
+            }
+        }
+        std::ranges::sort(types, std::greater{}, [](const TypeStats* t) { return t->liveBytes.load(std::memory_order_relaxed); });
+
+        std::string out = std::format("{:<12}{:<12}{:<12}{:<12}{}\n", "Live bytes", "Live", "Bytes", "Allocations", "Type");
+        for (auto type : types) {
+            // objects made before counting started and freed since are left out rather than shown below zero
+            auto live = std::max<ptrdiff_t>(type->live.load(std::memory_order_relaxed), 0);
+            auto liveBytes = std::max<ptrdiff_t>(type->liveBytes.load(std::memory_order_relaxed), 0);
+            out += std::format("{:<12}{:<12}{:<12}{:<12}{}\n", liveBytes, live, type->bytes.load(std::memory_order_relaxed),
+                               type->allocations.load(std::memory_order_relaxed), shortName(type->name));
+        }
+
+        std::scoped_lock lock(sitesLock);
+        if (sites.empty()) {
+            return out;
+        }
+        std::vector<const SiteStats*> bySize;
+        for (const auto& [key, stats] : sites) {
+            bySize.push_back(&stats);
+        }
+        std::ranges::sort(bySize, std::greater{}, &SiteStats::bytes);
+        // the sites that allocated the most
+        constexpr size_t SITES_SHOWN = 20;
+        out += std::format("\n{:<12}{:<12}{}\n", "Bytes", "Allocations", "Site");
+        for (auto stats : bySize | std::views::take(SITES_SHOWN)) {
+            if (stats->line == 0) {
+                out += std::format("{:<12}{:<12}{}\n", stats->bytes, stats->allocations, stats->name);
+            } else {
+                out += std::format("{:<12}{:<12}{} line {}\n", stats->bytes, stats->allocations, stats->name, stats->line);
+            }
+        }
+        return out;
+    }
+}
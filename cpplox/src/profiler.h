@@ -0,0 +1,136 @@
+#ifndef CPPLOX_PROFILER_H_
+#define CPPLOX_PROFILER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Counts what the heap is being used for. Every type allocated through allocate<T>, reallocate<T> or
+// SharedPtr::Make has its own counts, kept only while counting is on so the allocator pays for one
+// branch otherwise. With sites on too, each allocation is also put down to the line of the Lox
+// function that was running when it happened
+namespace lox {
+    // the name the compiler gives T, pulled out of the signature of this function
+    template <typename T>
+    constexpr std::string_view typeName() {
+        std::string_view signature = __PRETTY_FUNCTION__;
+        auto start = signature.find("T = ") + 4;
+        // "[with T = int; ...]", an array type has brackets of its own so only the last one ends it
+        auto end = std::min(signature.find(';', start), signature.rfind(']'));
+        return signature.substr(start, end - start);
+    }
+
+    class HeapProfiler {
+    public:
+        struct TypeStats {
+            explicit TypeStats(std::string_view name);
+            std::string_view name;
+            std::atomic<size_t> allocations = 0;
+            std::atomic<size_t> bytes = 0;
+            // what was allocated before counting started can be freed after, so these can go below zero
+            std::atomic<ptrdiff_t> live = 0;
+            std::atomic<ptrdiff_t> liveBytes = 0;
+            TypeStats* next = nullptr;  // every type that has been seen, newest first
+        };
+
+        // where in the script an allocation happened, function is only used to tell sites apart
+        struct Site {
+            const void* function = nullptr;
+            std::string_view name;
+            size_t line = 0;
+        };
+        using SiteLookup = Site (*)(const void* context);
+
+        template <typename T>
+        static TypeStats& statsFor() {
+            static TypeStats stats(typeName<T>());
+            return stats;
+        }
+
+        template <typename T>
+        void allocated(size_t bytes) {
+            if (counting) [[unlikely]] {
+                auto& stats = statsFor<T>();
+                stats.allocations.fetch_add(1, std::memory_order_relaxed);
+                stats.bytes.fetch_add(bytes, std::memory_order_relaxed);
+                stats.live.fetch_add(1, std::memory_order_relaxed);
+                stats.liveBytes.fetch_add(ptrdiff_t(bytes), std::memory_order_relaxed);
+                if (trackSites) {
+                    recordSite(bytes);
+                }
+            }
+        }
+
+        template <typename T>
+        void freed(size_t bytes) {
+            if (counting) [[unlikely]] {
+                auto& stats = statsFor<T>();
+                stats.live.fetch_sub(1, std::memory_order_relaxed);
+                stats.liveBytes.fetch_sub(ptrdiff_t(bytes), std::memory_order_relaxed);
+            }
+        }
+
+        // a block of Ts going from oldBytes to newBytes, counted as an allocation when it is new
+        template <typename T>
+        void resized(size_t oldBytes, size_t newBytes) {
+            if (oldBytes == 0) {
+                allocated<T>(newBytes);
+            } else if (newBytes == 0) {
+                freed<T>(oldBytes);
+            } else if (counting) [[unlikely]] {
+                statsFor<T>().liveBytes.fetch_add(ptrdiff_t(newBytes) - ptrdiff_t(oldBytes), std::memory_order_relaxed);
+            }
+        }
+
+        // a running VM says where it is through lookup until the scope ends, then whichever VM was
+        // running before it does again
+        class WatchScope {
+        public:
+            WatchScope(const void* context, SiteLookup lookup);
+            ~WatchScope();
+            WatchScope(const WatchScope&) = delete;
+            WatchScope& operator=(const WatchScope&) = delete;
+
+        private:
+            const void* previousContext;
+            SiteLookup previousLookup;
+        };
+        std::string report() const;
+
+        bool counting = false;
+        bool trackSites = false;  // only looked at while counting
+
+    private:
+        struct SiteStats {
+            std::string name;
+            size_t line = 0;
+            size_t allocations = 0;
+            size_t bytes = 0;
+        };
+        struct SiteKey {
+            const void* function;
+            size_t line;
+            friend bool operator==(const SiteKey&, const SiteKey&) = default;
+        };
+        struct SiteHash {
+            size_t operator()(const SiteKey& key) const {
+                return std::hash<const void*>{}(key.function) ^ (key.line * 0x9E3779B97F4A7C15);
+            }
+        };
+
+        void recordSite(size_t bytes);
+
+        const void* context = nullptr;
+        SiteLookup lookup = nullptr;
+        // kept with the standard allocator so recording a site doesn't allocate from the heap it measures
+        mutable std::mutex sitesLock;
+        std::unordered_map<SiteKey, SiteStats, SiteHash> sites;
+    };
+
+    extern HeapProfiler profiler;
+}
+#endif
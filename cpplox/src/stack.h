@@ -6,6 +6,7 @@
 #include <iterator>
 #include <limits>
 #include <sstream>
+#include <utility>
 
 #include "algorithm.h"
 #include "array.h"
@@ -21,7 +22,7 @@ namespace lox {
         }
 
         void push(T value) {
-            *_top = value;
+            *_top = std::move(value);
             _top++;
         }
 
@@ -71,16 +72,28 @@ namespace lox {
             stack.clear();
         }
 
-        void push(T value) {
+        void push(const T& value) {
             stack.push_back(value);
         }
 
+        void push(T&& value) {
+            stack.push_back(std::move(value));
+        }
+
         T pop() {
-            auto value = top();
-            stack.pop_back();
+            auto value = std::move(top());
+            stack.truncate(stack.size() - 1);
             return value;
         }
 
+        // drops the top count values without handing them back
+        void discard(size_t count) {
+            if (stack.size() < count) {
+                throw lox::Exception("Can't discard more than is on the stack", nullptr);
+            }
+            stack.truncate(stack.size() - count);
+        }
+
         T& top() {
             if (stack.size() == 0) {
                 throw lox::Exception("Can't pop from empty stack", nullptr);
@@ -106,6 +106,43 @@ namespace lox {
             return k;
         }
 
+        // calls f with the value of every entry
+        template <typename F>
+        void forEachValue(F&& f) {
+            for (auto& entry : entries) {
+                if (std::holds_alternative<Entry>(entry)) {
+                    f(std::get<Entry>(entry).value);
+                }
+            }
+        }
+        template <typename F>
+        void forEachValue(F&& f) const {
+            for (const auto& entry : entries) {
+                if (std::holds_alternative<Entry>(entry)) {
+                    f(std::get<Entry>(entry).value);
+                }
+            }
+        }
+
+        // calls f with the key and the value of every entry
+        template <typename F>
+        void forEach(F&& f) const {
+            for (const auto& entry : entries) {
+                if (std::holds_alternative<Entry>(entry)) {
+                    f(std::get<Entry>(entry).key, std::get<Entry>(entry).value);
+                }
+            }
+        }
+
+        void compact() {
+            entries.compact();
+        }
+
+        // what the entries take up, the empty ones too
+        size_t bytes() const {
+            return entries.size() * sizeof(TableEntry);
+        }
+
         bool
         erase(const K& key) {
             auto index = getKeyIndex(entries, key);
@@ -152,6 +189,11 @@ namespace lox {
             return table.getKey(key);
         }
 
+        // puts key in the place of the equal one already there, or adds it
+        void replace(const K& key) {
+            table.insert(key, nullptr);
+        }
+
         bool contains(const K& key) const {
             return table.getKey(key).hasValue();
         }
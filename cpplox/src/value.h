@@ -5,11 +5,16 @@
 #include <variant>
 
 #include "expected.h"
+#include "gc.h"
 #include "interned.h"
 #include "memory.h"
 #include "object.h"
 #include "span.h"
 #include "stack.h"
+#include "table.h"
+#ifdef LOX_NAN_BOXING
+#include "nanbox.h"
+#endif
 namespace lox {
 
     class NativeFunction;
@@ -19,39 +24,80 @@ namespace lox {
     class Class;
     class Instance;
     class BoundMethod;
+    class WeakRef;
+    class WeakMap;
+#ifndef LOX_NAN_BOXING
     using Value = std::variant<bool, std::nullptr_t, double, InternedString, SharedPtr<Function>, SharedPtr<NativeFunction>,
-                               SharedPtr<Closure>, SharedPtr<UpValueObj>, SharedPtr<Class>, SharedPtr<Instance>, SharedPtr<BoundMethod>>;
+                               SharedPtr<Closure>, SharedPtr<UpValueObj>, SharedPtr<Class>, SharedPtr<Instance>, SharedPtr<BoundMethod>,
+                               SharedPtr<WeakRef>, SharedPtr<WeakMap>>;
+
+    // values are only looked at through these, so the NaN-boxed representation can stand in for the variant
+    template <typename T>
+    bool is(const Value& value) {
+        return std::holds_alternative<T>(value);
+    }
+
+    template <typename T>
+    const T& as(const Value& value) {
+        return std::get<T>(value);
+    }
+
+    // the object a value holds, without taking a reference to it
+    template <typename T>
+    T* borrow(const Value& value) {
+        return *std::get<SharedPtr<T>>(value);
+    }
+
+    template <typename F>
+    decltype(auto) visit(F&& f, const Value& value) {
+        return std::visit(std::forward<F>(f), value);
+    }
+#endif
 
     using Callable = std::variant<SharedPtr<Function>, SharedPtr<Closure>>;
 
-    inline Callable toCallable(Value v) {
-        if (std::holds_alternative<SharedPtr<Function>>(v)) {
-            return std::get<SharedPtr<Function>>(v);
+    inline Callable toCallable(const Value& v) {
+        if (is<SharedPtr<Function>>(v)) {
+            return as<SharedPtr<Function>>(v);
         }
-        if (std::holds_alternative<SharedPtr<Closure>>(v)) {
-            return std::get<SharedPtr<Closure>>(v);
+        if (is<SharedPtr<Closure>>(v)) {
+            return as<SharedPtr<Closure>>(v);
         }
         throw Exception("Is not a callable", nullptr);
     }
-    struct UpValueObj {
+    struct UpValueObj : public Traced {
+        UpValueObj(Value* location) : location(location) {}
         Value* location;
         Value closed = nullptr;
 
-        friend bool operator<(const UpValueObj& obj, const UpValueObj& obj2) {
-            // larger locations should be earlier in the list
-            return obj.location > obj2.location;
-        }
+        void trace(Collector& collector) const override;
+        void clearReferences(Graveyard& graveyard) override;
 
         void close() {
             closed = *location;
             location = &closed;
+            written();
+        }
+
+        bool isClosed() const {
+            return location == &closed;
         }
     };
+    // natives report failures with a code rather than an allocated message
+    enum class NativeError : uint8_t {
+        WrongArgumentCount,
+        WrongArgumentType,
+        InvalidRange
+    };
+    const char* toMessage(NativeError error);
+
     class NativeFunction {
     public:
-        using Func = std::function<Expected<Value, String>(Span<Value>)>;
+        using Result = Expected<Value, NativeError>;
+        // a plain function pointer, the span is the arguments sitting on the VM stack
+        using Func = Result (*)(Span<Value>);
         NativeFunction(Func f, size_t argCount);
-        Expected<Value, String> invoke(size_t args, Span<Value> values);
+        Result invoke(Span<Value> values) const;
 
         friend bool operator==(const NativeFunction& f1, const NativeFunction& f2) {
             return &f1 == &f2;
@@ -62,36 +108,42 @@ namespace lox {
         size_t argCount;
     };
 
-    inline bool isFalsey(Value value) {
-        return std::holds_alternative<nullptr_t>(value) || (std::holds_alternative<bool>(value) && !std::get<bool>(value));
+    inline bool isFalsey(const Value& value) {
+        return is<nullptr_t>(value) || (is<bool>(value) && !as<bool>(value));
     }
 
-    inline bool isString(Value value) {
-        return std::holds_alternative<InternedString>(value);
+    inline bool isString(const Value& value) {
+        return is<InternedString>(value);
     }
 
-    inline bool isNumber(Value value) {
-        return std::holds_alternative<double>(value);
+    inline bool isNumber(const Value& value) {
+        return is<double>(value);
     }
-    inline bool isFunction(Value value) {
-        return std::holds_alternative<SharedPtr<Function>>(value);
+    inline bool isFunction(const Value& value) {
+        return is<SharedPtr<Function>>(value);
     }
 
-    class Closure {
+    class Closure : public Traced {
     public:
         Closure(SharedPtr<Function> f);
-        SharedPtr<Function> getFunction() const;
+        const SharedPtr<Function>& getFunction() const;
         void addUpValue(SharedPtr<UpValueObj> obj);
 
-        SharedPtr<UpValueObj> getUpValue(size_t index) const;
+        const SharedPtr<UpValueObj>& getUpValue(size_t index) const;
         void setUpValue(size_t index, Value value);
+        // the object and the storage it owns, not what it refers to
+        size_t heapSize() const;
+
+        void trace(Collector& collector) const override;
+        void clearReferences(Graveyard& graveyard) override;
+        void compactBuffers() override;
 
     private:
         SharedPtr<Function> f;
-        Vector<SharedPtr<UpValueObj>> upvalues;
+        SmallVector<SharedPtr<UpValueObj>, 2> upvalues;  // most closures capture one or two
     };
 
-    class Class {
+    class Class : public Traced {
     public:
         Class(InternedString name);
 
@@ -101,6 +153,11 @@ namespace lox {
         void setInitializer(Value method);
         Optional<Value> getInitializer() const;
         void inherit(const Class& super);
+        size_t heapSize() const;
+
+        void trace(Collector& collector) const override;
+        void clearReferences(Graveyard& graveyard) override;
+        void compactBuffers() override;
 
     private:
         InternedString name;
@@ -108,7 +165,7 @@ namespace lox {
         Optional<Value> initializer;
     };
 
-    class Instance {
+    class Instance : public Traced {
     public:
         Instance(SharedPtr<Class> cls);
         StringView getName() const;
@@ -117,24 +174,84 @@ namespace lox {
         bool hasField(InternedString s) const;
         void deleteField(InternedString s);
         SharedPtr<Class> getClass() const;
+        size_t heapSize() const;
+
+        void trace(Collector& collector) const override;
+        void clearReferences(Graveyard& graveyard) override;
+        void compactBuffers() override;
 
     private:
         SharedPtr<Class> cls;
         Table<InternedString, Value> fields;
     };
 
-    class BoundMethod {
+    class BoundMethod : public Traced {
     public:
         BoundMethod(Value receiver, Callable method);
         Callable getMethod() const;
         Value getReceiver() const;
 
+        void trace(Collector& collector) const override;
+        void clearReferences(Graveyard& graveyard) override;
+
     private:
         Value receiver;
         Callable method;
     };
 
-    inline SharedPtr<Function> getFunction(Callable callable) {
+    // An object held without keeping it alive, nil once the object has gone. Only the collector's
+    // objects can be held weakly, and every weak reference to one object is the same WeakRef
+    class WeakRef {
+    public:
+        using Revive = Value (*)(void* handle);
+        WeakRef(void* handle, Revive revive);
+        // the WeakRef of the object in value, made if there isn't one yet, null for a value that
+        // can't be held weakly
+        static SharedPtr<WeakRef> of(const Value& value);
+        // only the one there is already
+        static SharedPtr<WeakRef> find(const Value& value);
+        static void expire(const Traced* object);
+
+        Value get() const;
+        bool expired() const {
+            return handle == nullptr;
+        }
+
+    private:
+        void* handle;  // the object's control block, not counted
+        Revive revive;  // makes a value of the object's type from the handle
+    };
+
+    // A table keyed by objects it doesn't keep alive. An entry can't be found once its key has gone,
+    // and its value is let go of when the table next sweeps, which it does as entries are added.
+    // A value that refers to its own key keeps the key alive for as long as the table is
+    class WeakMap : public Traced {
+    public:
+        Optional<Value> get(const Value& key) const;
+        // false when the key can't be held weakly
+        bool set(const Value& key, Value value);
+        bool erase(const Value& key);
+        size_t heapSize() const;
+
+        void trace(Collector& collector) const override;
+        void clearReferences(Graveyard& graveyard) override;
+        void compactBuffers() override;
+
+    private:
+        struct Key {
+            SharedPtr<WeakRef> ref;
+            size_t getHash() const;
+            friend bool operator==(const Key&, const Key&) = default;
+        };
+        void sweep();
+
+        static constexpr size_t MIN_SWEEP = 8;
+        Table<Key, Value> entries;
+        size_t addedSinceSweep = 0;
+        size_t sweepAt = MIN_SWEEP;  // entries added before the next sweep, as many as were alive at the last
+    };
+
+    inline const SharedPtr<Function>& getFunction(const Callable& callable) {
         return std::holds_alternative<SharedPtr<Function>>(callable) ? std::get<SharedPtr<Function>>(callable) : std::get<SharedPtr<Closure>>(callable)->getFunction();
     }
 }
@@ -151,7 +268,7 @@ struct std::formatter<lox::Value> : std::formatter<std::string> {
     template <class FormatContext>
     FormatContext::iterator format(const lox::Value& v, FormatContext& ctx) const {
         using namespace std::string_literals;
-        auto s = std::visit(
+        auto s = lox::visit(
             // I technically can use the LoxString here and not cheat and use stl string
             // but I don't care enough for printing to screen, the string formatter is way easier to use
             overload{
@@ -165,6 +282,8 @@ struct std::formatter<lox::Value> : std::formatter<std::string> {
                 [&ctx](lox::SharedPtr<lox::BoundMethod> b) { return std::string(lox::getFunction(b->getMethod())->getName().str().c_str()) + " method"s; },
                 [&ctx](lox::SharedPtr<lox::Closure> f) { return std::string(f->getFunction()->getName().str().c_str()); },
                 [&ctx](lox::SharedPtr<lox::NativeFunction>) { return "<native fn>"s; },
+                [&ctx](lox::SharedPtr<lox::WeakRef>) { return "<weak ref>"s; },
+                [&ctx](lox::SharedPtr<lox::WeakMap>) { return "<weak map>"s; },
                 [&ctx](lox::SharedPtr<lox::UpValueObj> v) { return std::format("{}", *(v->location)); }},
             v);
         return std::formatter<std::string>::format(s, ctx);
@@ -2,6 +2,8 @@
 #define CLOXCPP_VECTOR_H_
 
 #include <cstring>
+#include <memory>
+#include <type_traits>
 
 #include "algorithm.h"
 #include "array.h"
@@ -23,6 +25,7 @@ namespace lox {
         }
 
         Vector(const Vector& rhs) {
+            reserveExactly(rhs.count);
             push_back(rhs.begin(), rhs.end());
         }
         Vector& operator=(const Vector& rhs) {
@@ -59,14 +62,12 @@ namespace lox {
 
         void resize(size_t newSize, const T& value) {
             if (count > newSize) {
-                for (size_t index = count; index > newSize; --index) {
-                    eraseAt(index - 1);
-                }
+                truncate(newSize);
             } else if (count < newSize) {
-                reserve(newSize);
-                for (size_t index = count; index < newSize; ++index) {
-                    push_back(value);
-                }
+                T fill(value);  // value could be in this vector and move when it grows
+                adjustCapacity(newSize - count);
+                std::uninitialized_fill(data + count, data + newSize, fill);
+                count = newSize;
             }
         }
 
@@ -90,6 +91,14 @@ namespace lox {
             return this->data[count - 1];
         }
 
+        // moves the elements lower down in the arena if there is room, they are moved bytewise the
+        // way growing does, so nothing may point into them
+        void compact() {
+            if (capacity) {
+                data = static_cast<T*>(relocateBytes(data));
+            }
+        }
+
         void clear() {
             if (capacity) {
                 for (size_t i = 0; i < count; ++i) {
@@ -122,15 +131,28 @@ namespace lox {
             return count;
         }
 
-        void push_back(T value) {
-            push_back(&value, (&value) + 1);
+        void push_back(const T& value) {
+            push_back(T(value));  // copied first, value could be in this vector and move when it grows
+        }
+
+        void push_back(T&& value) {
+            adjustCapacity(1);
+            std::construct_at(data + count, std::move(value));
+            count++;
         }
 
         // assumes that we can ptrdiff it
         void push_back(const T* begin, const T* end) {
             auto requestedSize = end - begin;
+            if (requestedSize == 0) {
+                return;
+            }
             adjustCapacity(requestedSize);
-            lox::ranges::uninitialized_copy(lox::Span(begin, requestedSize), data + count);
+            if constexpr (std::is_trivially_copyable_v<T>) {
+                std::memcpy(data + count, begin, requestedSize * sizeof(T));
+            } else {
+                lox::ranges::uninitialized_copy(lox::Span(begin, requestedSize), data + count);
+            }
             count += requestedSize;
         }
 
@@ -138,14 +160,24 @@ namespace lox {
             eraseAt(size() - 1);
         }
 
+        // destroys everything past newSize, but keeps the allocation around
+        void truncate(size_t newSize) {
+            if (newSize > count) {
+                throw lox::Exception("Can't truncate a vector to a larger size", nullptr);
+            }
+            for (size_t index = newSize; index < count; ++index) {
+                std::destroy_at(data + index);
+            }
+            count = newSize;
+        }
+
         void eraseAt(size_t index) {
             if (index >= count) {
                 throw lox::Exception("Can't erase past our usual index", nullptr);
             }
+            // the elements after it slide down bytewise, the same way growing moves them
             std::destroy_at(data + index);
-            for (; index < count - 1; ++index) {
-                data[index] = data[index - 1];
-            }
+            std::memmove(static_cast<void*>(data + index), data + index + 1, (count - index - 1) * sizeof(T));
             count--;
             // shrink where we need to. I don't want to go by two becuase
             // we would thrash at boundaries
@@ -174,20 +206,166 @@ namespace lox {
                 newCapacity = std::max(8uz, newCapacity * 2);
             }
             if (newCapacity != capacity) {
-                data =
-                    (T*)reallocate(data, sizeof(T) * capacity, sizeof(T) * newCapacity);
-                if (data == nullptr) {
-                    throw lox::Exception("Could not allocate enough memory", nullptr);
-                }
-                capacity = newCapacity;
+                reserveExactly(newCapacity);
             }
         }
 
+        // the elements are moved bytewise, which arena blocks can often do by growing in place
+        void reserveExactly(size_t newCapacity) {
+            if (newCapacity <= capacity) {
+                return;
+            }
+            data = (T*)reallocate(data, sizeof(T) * capacity, sizeof(T) * newCapacity);
+            if (data == nullptr) {
+                throw lox::Exception("Could not allocate enough memory", nullptr);
+            }
+            capacity = newCapacity;
+        }
+
         T* data = nullptr;
         size_t count = 0;
         size_t capacity = 0;
     };
 
+    // A vector that keeps its first N elements inside itself, for the ones that seldom get longer
+    // than that. The inline elements are found from where the vector is rather than through a
+    // pointer, so it can be moved bytewise like the elements of any other vector
+    template <typename T, size_t N>
+    class SmallVector {
+    public:
+        using iterator = T*;
+        using const_iterator = const T*;
+        using value_type = T;
+        SmallVector() {}
+
+        ~SmallVector() {
+            clear();
+        }
+
+        SmallVector(const SmallVector& rhs) {
+            for (const auto& value : rhs) {
+                push_back(value);
+            }
+        }
+        SmallVector& operator=(const SmallVector& rhs) {
+            if (this != &rhs) {
+                clear();
+                for (const auto& value : rhs) {
+                    push_back(value);
+                }
+            }
+            return *this;
+        }
+
+        SmallVector(SmallVector&& rhs) {
+            take(rhs);
+        }
+        SmallVector& operator=(SmallVector&& rhs) {
+            if (this != &rhs) {
+                clear();
+                take(rhs);
+            }
+            return *this;
+        }
+
+        const T& operator[](size_t index) const {
+            if (index >= count) {
+                throw lox::Exception("Index out of bounds for vector access", nullptr);
+            }
+            return begin()[index];
+        }
+        T& operator[](size_t index) {
+            if (index >= count) {
+                throw lox::Exception("Index out of bounds for vector access", nullptr);
+            }
+            return begin()[index];
+        }
+
+        const T* begin() const {
+            return isInline() ? reinterpret_cast<const T*>(storage.local) : storage.heap;
+        }
+        const T* end() const {
+            return begin() + count;
+        }
+        T* begin() {
+            return isInline() ? reinterpret_cast<T*>(storage.local) : storage.heap;
+        }
+        T* end() {
+            return begin() + count;
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        // what has been allocated for elements that didn't fit inline
+        size_t allocatedBytes() const {
+            return isInline() ? 0 : capacity * sizeof(T);
+        }
+
+        void push_back(const T& value) {
+            push_back(T(value));  // copied first, value could be in this vector and move when it grows
+        }
+
+        void push_back(T&& value) {
+            if (count == capacity) {
+                grow();
+            }
+            std::construct_at(begin() + count, std::move(value));
+            count++;
+        }
+
+        void clear() {
+            std::destroy(begin(), end());
+            if (!isInline()) {
+                std::ignore = reallocate(storage.heap, capacity * sizeof(T), 0);
+            }
+            count = 0;
+            capacity = N;
+        }
+
+        void compact() {
+            if (!isInline()) {
+                storage.heap = static_cast<T*>(relocateBytes(storage.heap));
+            }
+        }
+
+    private:
+        bool isInline() const {
+            return capacity == N;
+        }
+
+        // leaving the inline elements is a copy of their bytes into a block of their own
+        void grow() {
+            size_t newCapacity = capacity * 2;
+            if (isInline()) {
+                T* heap = reallocate<T>(nullptr, 0, newCapacity * sizeof(T));
+                std::memcpy(static_cast<void*>(heap), storage.local, count * sizeof(T));
+                storage.heap = heap;
+            } else {
+                storage.heap = reallocate(storage.heap, capacity * sizeof(T), newCapacity * sizeof(T));
+            }
+            capacity = newCapacity;
+        }
+
+        void take(SmallVector& rhs) {
+            if (rhs.isInline()) {
+                std::memcpy(static_cast<void*>(storage.local), rhs.storage.local, rhs.count * sizeof(T));
+            } else {
+                storage.heap = rhs.storage.heap;
+            }
+            count = std::exchange(rhs.count, 0);
+            capacity = std::exchange(rhs.capacity, N);
+        }
+
+        union Storage {
+            T* heap;
+            alignas(T) std::byte local[N * sizeof(T)];
+        } storage;
+        uint32_t count = 0;
+        uint32_t capacity = N;
+    };
+
     template <typename T, size_t Capacity>
     class StaticVector {
     public:
@@ -1,115 +1,199 @@
 #include "vm.h"
 
 #include <chrono>
+#include <csignal>
 #include <print>
+#include <string>
+
+#include <unistd.h>
 
 #include "chunk.h"
+#include "collector.h"
 #include "compiler.h"
 #include "debug.h"
 #include "error.h"
+#include "heapdump.h"
 #include "optional.h"
 namespace lox {
     const size_t FRAMES_MAX = 64;
 
-    Expected<Value, String> clockNative(Span<Value>) {
+    // a heap dump is only asked for here, it is taken between instructions where every root is in view
+    static volatile std::sig_atomic_t heapDumpRequested = 0;
+    static std::string heapDumpPath;  // empty for the default, which has the process id in it
+
+    NativeFunction::Result clockNative() {
         return Value{double(std::chrono::steady_clock::now().time_since_epoch().count())};
     }
 
-    Expected<Value, String> hasfieldNative(Span<Value> values) {
-        if (values.size() != 2) {
-            return String("Must have three arguments");
-        }
-        auto val1 = *values.begin();
-        auto val2 = *(values.begin() + 1);
-        if (!std::holds_alternative<SharedPtr<Instance>>(val1) && !std::holds_alternative<InternedString>(val2)) {
-            return String{"Must pass in an instance and field name"};
-        }
-        auto instance = std::get<SharedPtr<Instance>>(val1);
-        auto fieldName = std::get<InternedString>(val2);
+    NativeFunction::Result hasfieldNative(const SharedPtr<Instance>& instance, const InternedString& fieldName) {
         return Value{instance->hasField(fieldName)};
     }
 
-    Expected<Value, String> setfieldNative(Span<Value> values) {
-        if (values.size() != 3) {
-            return String("Must have three arguments");
-        }
-        auto val1 = *values.begin();
-        auto val2 = *(values.begin() + 1);
-        auto val3 = *(values.begin() + 2);
-        if (!std::holds_alternative<SharedPtr<Instance>>(val1) && !std::holds_alternative<InternedString>(val2)) {
-            return String{"Must pass in an instance and field name"};
-        }
-        auto instance = std::get<SharedPtr<Instance>>(val1);
-        auto fieldName = std::get<InternedString>(val2);
-        instance->setField(fieldName, val3);
+    NativeFunction::Result setfieldNative(const SharedPtr<Instance>& instance, const InternedString& fieldName, const Value& value) {
+        instance->setField(fieldName, value);
         return Value{nullptr};
     }
 
-    Expected<Value, String> deletefieldNative(Span<Value> values) {
-        if (values.size() != 2) {
-            return String("Must have three arguments");
-        }
-        auto val1 = *values.begin();
-        auto val2 = *(values.begin() + 1);
-        if (!std::holds_alternative<SharedPtr<Instance>>(val1) && !std::holds_alternative<InternedString>(val2)) {
-            return String{"Must pass in an instance and field name"};
-        }
-        auto instance = std::get<SharedPtr<Instance>>(val1);
-        auto fieldName = std::get<InternedString>(val2);
+    NativeFunction::Result deletefieldNative(const SharedPtr<Instance>& instance, const InternedString& fieldName) {
         instance->deleteField(fieldName);
         return Value{nullptr};
     }
 
-    Expected<Value, String> random(Span<Value> values) {
-        if (values.size() != 2) {
-            return String{"Must have two arguments"};
-        }
-        auto val1 = *values.begin();
-        auto val2 = *(values.begin() + 1);
-        if (!std::holds_alternative<double>(val1) || !std::holds_alternative<double>(val2)) {
-            return String{"Must pass in numbers to random"};
-        }
-        int num1 = int(std::get<double>(val1));
-        int num2 = int(std::get<double>(val2));
+    NativeFunction::Result random(double low, double high) {
+        int num1 = int(low);
+        int num2 = int(high);
         if (num1 >= num2) {
-            return String{"Second number must be bigger than first number"};
+            return NativeError::InvalidRange;
         }
         return Value{double(num1 + rand() % (num2 - num1))};
     }
 
+    NativeFunction::Result weakrefNative(const Value& object) {
+        auto ref = WeakRef::of(object);
+        if (!ref) {
+            return NativeError::WrongArgumentType;
+        }
+        return Value{ref};
+    }
+
+    NativeFunction::Result derefNative(const SharedPtr<WeakRef>& ref) {
+        return ref->get();
+    }
+
+    NativeFunction::Result weakmapNative() {
+        return Value{SharedPtr<WeakMap>::Make()};
+    }
+
+    NativeFunction::Result weakgetNative(const SharedPtr<WeakMap>& map, const Value& key) {
+        auto value = map->get(key);
+        return value ? value.value() : Value{nullptr};
+    }
+
+    NativeFunction::Result weaksetNative(const SharedPtr<WeakMap>& map, const Value& key, const Value& value) {
+        if (!map->set(key, value)) {
+            return NativeError::WrongArgumentType;
+        }
+        return Value{nullptr};
+    }
+
+    NativeFunction::Result weakhasNative(const SharedPtr<WeakMap>& map, const Value& key) {
+        return Value{map->get(key).hasValue()};
+    }
+
+    NativeFunction::Result weakdeleteNative(const SharedPtr<WeakMap>& map, const Value& key) {
+        map->erase(key);
+        return Value{nullptr};
+    }
+
+    NativeFunction::Result memstatsNative() {
+        auto report = profiler.report();
+        if (currentBudget) {
+            report += std::format("\nThis VM has {} bytes in use, {} at peak\n", currentBudget->used, currentBudget->peak);
+        }
+        return Value{InternedString(String(report.data(), report.size()))};
+    }
+
+    NativeFunction::Result heapdumpNative(const InternedString& path) {
+        heapDumpPath = std::string(path.begin(), path.size());
+        heapDumpRequested = 1;
+        return Value{nullptr};
+    }
+
     VM::VM() {
-        defineNative("clock", clockNative, 0);
-        defineNative("random", random, 2);
-        defineNative("hasfield", hasfieldNative, 2);
-        defineNative("deletefield", deletefieldNative, 2);
-        defineNative("setfield", setfieldNative, 3);
+        defineNative<clockNative>("clock");
+        defineNative<random>("random");
+        defineNative<hasfieldNative>("hasfield");
+        defineNative<deletefieldNative>("deletefield");
+        defineNative<setfieldNative>("setfield");
+        defineNative<memstatsNative>("memstats");
+        defineNative<heapdumpNative>("heapdump");
+        defineNative<weakrefNative>("weakref");
+        defineNative<derefNative>("deref");
+        defineNative<weakmapNative>("weakmap");
+        defineNative<weakgetNative>("weakget");
+        defineNative<weaksetNative>("weakset");
+        defineNative<weakhasNative>("weakhas");
+        defineNative<weakdeleteNative>("weakdelete");
+        collector.addRoots(this, &VM::markRoots);
+    }
+
+    VM::~VM() {
+        collector.removeRoots(this);
+    }
+
+    // the line of the running function, the heap profiler puts allocations down to it
+    HeapProfiler::Site VM::allocationSite(const void* vm) {
+        const auto& frames = static_cast<const VM*>(vm)->frames;
+        if (frames.empty()) {
+            return {};
+        }
+        const auto& frame = frames.peek();
+        const auto& chunk = frame.getChunk();
+        auto offset = frame.getIp().getOffset();
+        if (offset >= chunk.size()) {
+            return {};
+        }
+        // an inlined body's instructions have the callee's lines, so they are put down to the callee
+        const auto* inlined = chunk.inlinedAt(offset);
+        const auto& function = inlined ? as<SharedPtr<Function>>(chunk.getConstant(inlined->callee)) : frame.getFunction();
+        auto name = function->getName();
+        return {*function, std::string_view(name.begin(), name.size()), chunk.getLineNumber(offset)};
     }
+
     InterpretResult VM::interpret(const String& s) {
-        Compiler compiler(s);
-        auto function = compiler.compile();
-        if (!function) {
+        BudgetScope scope(&budget);
+        try {
+            Compiler compiler(s);
+            auto function = compiler.compile();
+            if (!function) {
+                return InterpretResult::CompileError;
+            }
+            auto closure = SharedPtr<Closure>::Make(function);
+            stack.push(closure);
+            call(Callable{closure}, 0);
+        } catch (lox::Exception& e) {
+            // only running out of memory gets here, the compiler reports what is wrong with the source itself
+            std::println(std::cerr, "Error: {}", e.what());
+            frames.reset();
+            stack.reset();
             return InterpretResult::CompileError;
         }
-        auto closure = SharedPtr<Closure>::Make(function);
-        stack.push(closure);
-        call(Callable{closure}, 0);
         return run();
     }
 
+    void VM::setMemoryLimit(size_t bytes) {
+        budget.limit = bytes;
+    }
+
     bool areEqual(Value val1, Value val2) {
-        if (std::holds_alternative<InternedString>(val1) && std::holds_alternative<InternedString>(val2)) {
-            auto s1 = std::get<InternedString>(val1);
-            auto s2 = std::get<InternedString>(val2);
+#ifndef LOX_NAN_BOXING
+        // the boxed value compares its strings itself, the variant would compare them character by character
+        if (is<InternedString>(val1) && is<InternedString>(val2)) {
+            auto s1 = as<InternedString>(val1);
+            auto s2 = as<InternedString>(val2);
             return s1.getHash() == s2.getHash() && s1.begin() == s2.begin() && s1.size() == s2.size();
         }
+#endif
         return val1 == val2;
     }
 
     InterpretResult VM::run() {
+        HeapProfiler::WatchScope watch(this, &VM::allocationSite);
         Optional<InterpretResult> returnCode;
         try {
-            while (!frames.empty() && frames.top().getIp() != frames.top().getFunction()->getChunk()->end()) {
-                const auto& chunk = **frames.top().getFunction()->getChunk();
+            while (!frames.empty() && frames.top().getIp() != frames.top().getChunk().end()) {
+                if (collector.shouldCollect()) {
+                    collectGarbage();
+                }
+                if (heapDumpRequested) [[unlikely]] {
+                    dumpHeap();
+                }
+                if (freeQueue.pending()) [[unlikely]] {
+                    freeQueue.drain(freeQueue.budget);
+                } else if (budget.overdrawn) [[unlikely]] {
+                    settleBudget();
+                }
+                const auto& chunk = frames.top().getChunk();
                 auto& ip = frames.top().getIp();
                 if (diagnosticMode) {
                     std::println("{}", stack);
@@ -130,26 +214,29 @@ namespace lox {
                             callValue(stack.peek(c.value()), c.value());
                         },
                         [&chunk, this](const ClosureOp& c) {
-                            auto value = chunk.getConstant(c.value());
-                            if (!std::holds_alternative<SharedPtr<Function>>(value)) {
+                            const auto& value = chunk.getConstant(c.value());
+                            if (!is<SharedPtr<Function>>(value)) {
                                 throw Exception("Closure was not a function", nullptr);
                             }
-                            auto func = std::get<SharedPtr<Function>>(value);
-                            auto closure = SharedPtr<Closure>::Make(func);
+                            auto closure = SharedPtr<Closure>::Make(as<SharedPtr<Function>>(value));
                             stack.push(closure);
-                            for (auto upvalue : c.getUpValues()) {
+                            for (const auto& upvalue : c.getUpValues()) {
                                 if (upvalue.isLocal) {
                                     closure->addUpValue(captureUpValue(stack.begin() + frames.top().getOffset() + upvalue.index));
                                 } else {
-                                    auto sp = std::get<SharedPtr<Closure>>(frames.top().getCallable())->getUpValue(upvalue.index);
-                                    closure->addUpValue(sp);
+                                    closure->addUpValue(std::get<SharedPtr<Closure>>(frames.top().getCallable())->getUpValue(upvalue.index));
                                 }
                             }
                         },
+                        [&chunk, this](const LocalFunctionOp& f) {
+                            stack.push(chunk.getConstant(f.value()));
+                        },
+                        [this](const GetOuterLocal& g) { stack.push(outerLocal(g.value())); },
+                        [this](const SetOuterLocal& s) { outerLocal(s.value()) = stack.peek(); },
                         [&chunk, this](const Constant& c) {
                             stack.push(chunk.getConstant(c.value()));
                         },
-                        [&chunk, this](const ClassOp& c) { stack.push(SharedPtr<Class>::Make(std::get<InternedString>(chunk.getConstant(c.value())))); },
+                        [&chunk, this](const ClassOp& c) { stack.push(SharedPtr<Class>::Make(as<InternedString>(chunk.getConstant(c.value())))); },
                         [&chunk, this](const LongConstant& c) {
                             stack.push(chunk.getConstant(c.value()));
                         },
@@ -162,30 +249,27 @@ namespace lox {
                         [&chunk, &returnCode, this](const GetLocal& g) { pushLocal(g.value()); },
                         [&chunk, &returnCode, this](const SetLocal& s) { assignLocal(s.value()); },
                         [&chunk, &returnCode, this](const GetProperty& g) {
-                            if (!std::holds_alternative<SharedPtr<Instance>>(stack.peek())) {
+                            if (!is<SharedPtr<Instance>>(stack.peek())) {
                                 throw Exception("Only instances have properties.", nullptr);
                             }
-                            auto instance = std::get<SharedPtr<Instance>>(stack.peek());
-                            auto name = std::get<InternedString>(chunk.getConstant(g.value()));
+                            auto instance = borrow<Instance>(stack.peek());
+                            const auto& name = as<InternedString>(chunk.getConstant(g.value()));
                             auto value = instance->getField(name);
                             if (value.hasValue()) {
-                                stack.pop();
-                                stack.push(value.value());
+                                stack.top() = std::move(value.value());
                             } else {
                                 bindMethod(instance->getClass(), name);
                             }
                         },
                         [&chunk, &returnCode, this](const SetProperty& s) {
-                            if (!std::holds_alternative<SharedPtr<Instance>>(stack.peek(1))) {
+                            if (!is<SharedPtr<Instance>>(stack.peek(1))) {
                                 throw Exception("Only instances have properties.", nullptr);
                             }
 
-                            auto instance = std::get<SharedPtr<Instance>>(stack.peek(1));
-                            auto name = std::get<InternedString>(chunk.getConstant(s.value()));
-                            instance->setField(name, stack.peek());
+                            auto instance = borrow<Instance>(stack.peek(1));
+                            instance->setField(as<InternedString>(chunk.getConstant(s.value())), stack.peek());
                             auto v = stack.pop();
-                            stack.pop();
-                            stack.push(v);
+                            stack.top() = std::move(v);
                         },
                         [&chunk, &returnCode, this](const GetUpValue& g) {
                             if (!std::holds_alternative<SharedPtr<Closure>>(frames.top().getCallable())) {
@@ -208,21 +292,20 @@ namespace lox {
                             ip.resetBy(l.value());
                             jumped = true; },
                         [this](const Inherit&) {
-                            auto superclass = stack.peek(1);
-                            if (!std::holds_alternative<SharedPtr<Class>>(superclass)) {
+                            const auto& superclass = stack.peek(1);
+                            if (!is<SharedPtr<Class>>(superclass)) {
                                 throw Exception("Superclass must be a class.", nullptr);
                             }
-                            auto subclass = std::get<SharedPtr<Class>>(stack.peek());
-                            subclass->inherit(**std::get<SharedPtr<Class>>(superclass));
+                            borrow<Class>(stack.peek())->inherit(*borrow<Class>(superclass));
                             stack.pop();
                         },
                         [&chunk, this](const MethodOp& m) {
-                            defineMethod(std::get<InternedString>(chunk.getConstant(m.value())));
+                            defineMethod(as<InternedString>(chunk.getConstant(m.value())));
                         },
-                        [&chunk, this](const Initializer& i) { defineMethod(std::get<InternedString>(chunk.getConstant(i.value())), true); },
+                        [&chunk, this](const Initializer& i) { defineMethod(as<InternedString>(chunk.getConstant(i.value())), true); },
                         [&chunk, this](const GetSuper& g) {
-                            auto name = std::get<InternedString>(chunk.getConstant(g.value()));
-                            auto superclass = std::get<SharedPtr<Class>>(stack.pop());
+                            auto name = as<InternedString>(chunk.getConstant(g.value()));
+                            auto superclass = as<SharedPtr<Class>>(stack.pop());
                             bindMethod(superclass, name);
                         },
                         [this](const Negate&) {
@@ -240,10 +323,8 @@ namespace lox {
                             if (frames.empty()) {
                                 stack.pop();
                             } else {
-                                while (stack.size() > lastFrame.getOffset()) {
-                                    stack.pop();  // go back down to before the offset
-                                }
-                                stack.push(result);
+                                stack.discard(stack.size() - lastFrame.getOffset());  // go back down to before the offset
+                                stack.push(std::move(result));
                             }
                             jumped = true;
                         },
@@ -251,14 +332,25 @@ namespace lox {
                         [&chunk, &returnCode, this](const LongSetGlobal& g) { returnCode = assignGlobal(chunk, g.value()); },
                         [this](const True&) { stack.push(true); },
                         [this, &chunk](const Invoke& i) {
-                            auto name = chunk.getConstant(i.value());
-                            invoke(std::get<InternedString>(name), i.getArgumentCount());
+                            invoke(as<InternedString>(chunk.getConstant(i.value())), i.getArgumentCount());
                         },
                         [this, &chunk](const SuperInvoke& i) {
-                            auto name = std::get<InternedString>(chunk.getConstant(i.value()));
-                            auto superclass = std::get<SharedPtr<Class>>(stack.pop());
+                            auto name = as<InternedString>(chunk.getConstant(i.value()));
+                            auto superclass = as<SharedPtr<Class>>(stack.pop());
                             invokeFromClass(superclass, name, i.getArgumentCount());
                         },
+                        [&chunk, &ip, &jumped, this](const InlineGuard& g) {
+                            if (!areEqual(stack.peek(g.getArgumentCount()), chunk.getConstant(g.getConstant()))) {
+                                ip += g.value();
+                                jumped = true;
+                            }
+                        },
+                        [this](const InlineReturn& r) {
+                            auto result = stack.pop();
+                            stack.discard(r.value());  // the arguments and the callee
+                            stack.push(std::move(result));
+                        },
+                        [this](const Peek& p) { stack.push(stack.peek(p.value())); },
                         [&returnCode](const Unknown&) { returnCode = InterpretResult::CompileError; }},
                     instruction.instruction());
 
@@ -272,7 +364,15 @@ namespace lox {
         } catch (lox::Exception& e) {
             std::println(std::cerr, "Error: {}", e.what());
             for (auto f : views::reversed<DynamicStack<CallFrame>>(frames)) {
-                std::println(std::cerr, "[Line {} in {}]", f.getFunction()->getChunk()->getLineNumber(f.getIp()->offset()), f.getFunction()->getName());
+                auto chunk = f.getFunction()->getChunk();
+                auto offset = f.getIp()->offset();
+                // an inlined body has no frame of its own, so it is reported as if the call had made one
+                if (auto inlined = chunk->inlinedAt(offset)) {
+                    std::println(std::cerr, "[Line {} in {}]", chunk->getLineNumber(offset), as<SharedPtr<Function>>(chunk->getConstant(inlined->callee))->getName());
+                    std::println(std::cerr, "[Line {} in {}]", inlined->callLine, f.getFunction()->getName());
+                } else {
+                    std::println(std::cerr, "[Line {} in {}]", chunk->getLineNumber(offset), f.getFunction()->getName());
+                }
             }
             while (!frames.empty()) {
                 frames.pop();
@@ -280,20 +380,24 @@ namespace lox {
             while (!stack.empty()) {
                 stack.pop();
             }
+            openUpValues.clear();
+            openUpValueCount = 0;
             return InterpretResult::RuntimeError;
         }
         return InterpretResult::Ok;
     }
 
     SharedPtr<UpValueObj> VM::captureUpValue(DynamicStack<Value>::iterator iter) {
-        auto node = openUpValues.findNextClosest(SharedPtr<UpValueObj>::Make(iter));
-        if (node && node->value->location == iter) {
-            return node->value;
+        size_t slot = iter - stack.begin();
+        if (slot >= openUpValues.size()) {
+            openUpValues.resize(slot + 1, SharedPtr<UpValueObj>{});
         }
-
-        auto created = SharedPtr<UpValueObj>::Make(iter);
-        openUpValues.insertBefore(created, node);
-        return created;
+        auto& upvalue = openUpValues[slot];
+        if (!upvalue) {
+            upvalue = SharedPtr<UpValueObj>::Make(iter);
+            openUpValueCount++;
+        }
+        return upvalue;
     }
 
     void VM::binaryOp(const Binary& bin) {
@@ -303,7 +407,7 @@ namespace lox {
         } else if (isString(stack.peek(0)) && isString(stack.peek(1)) && bin.opcode == OpCode::Add) {
             auto val2 = stack.pop();
             auto val1 = stack.pop();
-            stack.push(std::get<InternedString>(val1) + std::get<InternedString>(val2));
+            stack.push(as<InternedString>(val1) + as<InternedString>(val2));
         } else {
             throw lox::Exception("Invalid type for binary expression", nullptr);
         }
@@ -322,44 +426,48 @@ namespace lox {
 
     void VM::negate() {
         verifyNumber();
-        stack.push(-std::get<double>(stack.pop()));
+        stack.push(-as<double>(stack.pop()));
     }
 
     double VM::popNumber() {
         verifyNumber();
-        return std::get<double>(stack.pop());
+        return as<double>(stack.pop());
     }
 
     void VM::defineGlobal(const Chunk& chunk, uint32_t number) {
-        auto constant = chunk.getConstant(number);
-        if (!std::holds_alternative<InternedString>(constant)) {
+        const auto& constant = chunk.getConstant(number);
+        if (!is<InternedString>(constant)) {
             throw lox::Exception("Did not find a name for the global", nullptr);
         }
-        globals.insert(std::get<InternedString>(constant), stack.pop());
+        collector.shade(stack.peek());
+        globals.insert(as<InternedString>(constant), stack.pop());
+        globalsWritten = true;
     }
 
     InterpretResult VM::pushGlobal(const Chunk& chunk, uint32_t number) {
-        auto constant = chunk.getConstant(number);
-        if (!std::holds_alternative<InternedString>(constant)) {
+        const auto& constant = chunk.getConstant(number);
+        if (!is<InternedString>(constant)) {
             throw lox::Exception("Not a variable name", nullptr);
         }
-        auto s = std::get<InternedString>(constant);
+        auto s = as<InternedString>(constant);
         auto value = globals.get(s);
 
         if (!value) {
             std::println(std::cerr, "Undefined Variable {}", s.string());
             return InterpretResult::RuntimeError;
         }
-        stack.push(*value);
+        stack.push(std::move(*value));
         return InterpretResult::Ok;
     }
 
     InterpretResult VM::assignGlobal(const Chunk& chunk, uint32_t number) {
-        auto constant = chunk.getConstant(number);
-        if (!std::holds_alternative<InternedString>(constant)) {
+        const auto& constant = chunk.getConstant(number);
+        if (!is<InternedString>(constant)) {
             throw lox::Exception("Not a variable name", nullptr);
         }
-        auto s = std::get<InternedString>(constant);
+        auto s = as<InternedString>(constant);
+        collector.shade(stack.peek());
+        globalsWritten = true;
         if (globals.insert(s, stack.peek())) {
             globals.erase(s);
             std::println(std::cerr, "Undefined Variable {}", s.string());
@@ -376,11 +484,20 @@ namespace lox {
         frames.top().assign(number, stack.peek());
     }
 
-    void VM::callValue(Value callee, int argCount) {
-        std::visit(
+    // a local function that doesn't escape is only called by the frame that declared it
+    // so the variables it captured are still sitting in that frame's slots
+    Value& VM::outerLocal(size_t number) {
+        if (frames.size() < 2) {
+            throw Exception("Local function called outside of its frame", nullptr);
+        }
+        return stack[frames[frames.size() - 2].getOffset() + number];
+    }
+
+    void VM::callValue(const Value& callee, int argCount) {
+        lox::visit(
             overload{
-                [this, argCount](SharedPtr<Closure> func) { call(func, argCount); },
-                [this, argCount](SharedPtr<Function> func) { call(func, argCount); },
+                [this, argCount](const SharedPtr<Closure>& func) { call(func, argCount); },
+                [this, argCount](const SharedPtr<Function>& func) { call(func, argCount); },
                 [this, argCount](SharedPtr<Class> cls) {
                     stack[stack.size() - argCount - 1] = SharedPtr<Instance>::Make(cls);
                     auto init = cls->getInitializer();
@@ -389,17 +506,13 @@ namespace lox {
                     }
                 },
                 [this, argCount](SharedPtr<BoundMethod> method) { stack[stack.size() - argCount - 1] = method->getReceiver(); call(method->getMethod(), argCount); },
-                [this, argCount](SharedPtr<NativeFunction> func) {
-                    auto result = func->invoke(argCount, Span(stack.begin() + stack.size() - argCount, argCount));
-                    for (auto i = 0; i < argCount; i++) {
-                        stack.pop();  // pop args
-                    }
-                    // pop func
-                    stack.pop();
+                [this, argCount](const SharedPtr<NativeFunction>& func) {
+                    auto result = func->invoke(Span<Value>(stack.end() - argCount, argCount));
+                    stack.discard(argCount + 1);  // args and the function go in one adjustment, func is gone after it
                     if (!result.hasValue()) {
-                        throw Exception(result.error().c_str(), nullptr);
+                        throw Exception(toMessage(result.error()), nullptr);
                     }
-                    stack.push(result.value());
+                    stack.push(std::move(result.value()));
                 },
                 [this](auto) { throw Exception("Can only call functions and classes", nullptr); }},
             callee);
@@ -415,7 +528,7 @@ namespace lox {
         if (stack.size() < argCount + 1) {
             throw Exception("Stack corruption", nullptr);
         }
-        frames.push(CallFrame{func, stack, stack.size() - argCount - 1});
+        frames.push(CallFrame{std::move(func), stack, stack.size() - argCount - 1});
     }
 
     void VM::defineNative(StringView name, NativeFunction::Func f, size_t args) {
@@ -423,22 +536,126 @@ namespace lox {
     }
 
     void VM::closeUpValues(const DynamicStack<Value>::iterator iter) {
-        while (openUpValues.front() && openUpValues.front()->value->location >= iter) {
-            auto upvalue = openUpValues.front()->value;
-            upvalue->close();
-            openUpValues.popFront();
+        size_t from = iter - stack.begin();
+        for (size_t slot = from; slot < openUpValues.size() && openUpValueCount > 0; ++slot) {
+            if (auto& upvalue = openUpValues[slot]; upvalue) {
+                upvalue->close();
+                openUpValueCount--;
+            }
+        }
+        // everything from here up is closed, so keep the index no longer than the live stack
+        if (from < openUpValues.size()) {
+            openUpValues.truncate(from);
+        }
+    }
+
+    // over the memory limit, so everything the collector can find goes in one go before giving up.
+    // What that lets go of can still be freed a slice at a time, the budget settles once it has been
+    void VM::settleBudget() {
+        if (!collectedForBudget) {
+            collectedForBudget = true;
+            MemoryBudget::Lenience lenience(budget);
+            if (collector.usesTrialDeletion()) {
+                collector.collectCycles();
+            } else {
+                if (collector.collecting()) {
+                    collector.cancel();  // started over as a full collection that finishes now
+                }
+                collector.demandFull();
+                collector.beginCollection();
+                collector.markRoots(true);
+                collector.collect();
+            }
+            if (freeQueue.pending()) {
+                return;
+            }
+        }
+        collectedForBudget = false;
+        budget.settle();
+    }
+
+    // between instructions everything the program can still use is reachable from here
+    void VM::collectGarbage() {
+        // what the collector allocates for itself is charged, but a collection can't fail halfway
+        MemoryBudget::Lenience lenience(budget);
+        // trial deletion works from the objects the counts have buffered, it needs no roots
+        if (collector.usesTrialDeletion()) {
+            collector.collectCycles();
+            return;
+        }
+        if (collector.collecting()) {
+            if (collector.step()) {
+                // nothing tells the collector about changes to the stacks, so look at them again last
+                collector.markRoots(false);
+                collector.finishMarking();
+            }
+            return;
+        }
+        bool full = collector.beginCollection();
+        collector.markRoots(full);
+        collector.collect();
+    }
+
+    void VM::markRoots(void* context, bool full) {
+        auto& vm = *static_cast<VM*>(context);
+        vm.markStack();
+        // after any collection everything the globals hold is old, so unless one has been stored
+        // since, a young collection would find nothing new through them
+        if (full || vm.globalsWritten) {
+            vm.globals.forEachValue([](const Value& value) { collector.mark(value); });
+            vm.globalsWritten = false;
+        }
+    }
+
+    void VM::requestHeapDump() {
+        heapDumpRequested = 1;
+    }
+
+    // a dump that can't be written doesn't stop the program, it may well have come from a signal
+    void VM::dumpHeap() {
+        heapDumpRequested = 0;
+        auto path = heapDumpPath.empty() ? std::format("heap-{}.loxheap", getpid()) : std::exchange(heapDumpPath, {});
+        HeapDump dump;
+        for (const auto& value : stack) {
+            dump.addRoot("stack", value);
+        }
+        for (const auto& frame : frames) {
+            std::visit([&dump](const auto& function) { dump.addRoot("frame", Value{function}); }, frame.getCallable());
+        }
+        for (const auto& upvalue : openUpValues) {
+            if (upvalue) {
+                dump.addRoot("open upvalue", Value{upvalue});
+            }
+        }
+        globals.forEach([&dump](const InternedString& name, const Value& value) { dump.addRoot(name.string(), value); });
+        try {
+            dump.write(path.c_str());
+            std::println(std::cerr, "Heap dump written to {}", path);
+        } catch (lox::Exception& e) {
+            std::println(std::cerr, "Error: {}", e.what());
+        }
+    }
+
+    void VM::markStack() {
+        for (auto& value : stack) {
+            collector.mark(value);
+        }
+        for (auto& frame : frames) {
+            collector.mark(frame.getCallable());
+        }
+        for (auto& upvalue : openUpValues) {
+            collector.mark(upvalue);
         }
     }
 
     void VM::defineMethod(InternedString name, bool isInitializer) {
-        auto method = stack.peek();
-        auto cls = std::get<SharedPtr<Class>>(stack.peek(1));
+        auto method = stack.pop();
+        auto cls = borrow<Class>(stack.peek());
         if (isInitializer) {
-            cls->setInitializer(method);
+            cls->setInitializer(std::move(method));
         } else {
-            cls->setMethod(name, method);
+            cls->setMethod(name, std::move(method));
         }
-        stack.pop();
     }
 
     void VM::bindMethod(SharedPtr<Class> cls, InternedString name) {
@@ -448,22 +665,21 @@ namespace lox {
             throw Exception(s.c_str(), nullptr);
         }
 
-        SharedPtr<BoundMethod> method = std::visit(
+        SharedPtr<BoundMethod> method = lox::visit(
             overload{
-                [this](SharedPtr<Function>& f) { return SharedPtr<BoundMethod>::Make(stack.peek(), Callable{f}); },
-                [this](SharedPtr<Closure>& f) { return SharedPtr<BoundMethod>::Make(stack.peek(), Callable{f}); },
+                [this](const SharedPtr<Function>& f) { return SharedPtr<BoundMethod>::Make(stack.peek(), Callable{f}); },
+                [this](const SharedPtr<Closure>& f) { return SharedPtr<BoundMethod>::Make(stack.peek(), Callable{f}); },
                 [](auto) -> SharedPtr<BoundMethod> { throw Exception("Not callable", nullptr); return nullptr; }},
             value.value());
-        stack.pop();
-        stack.push(method);
+        stack.top() = std::move(method);
     }
 
     void VM::invoke(InternedString name, uint8_t argCount) {
-        auto value = stack.peek(argCount);
-        if (!std::holds_alternative<SharedPtr<Instance>>(value)) {
+        const auto& value = stack.peek(argCount);
+        if (!is<SharedPtr<Instance>>(value)) {
             throw Exception("Only instances have methods.", nullptr);
         }
-        auto receiver = std::get<SharedPtr<Instance>>(value);
+        auto receiver = borrow<Instance>(value);
         auto v = receiver->getField(name);
         if (v.hasValue()) {
             stack[stack.size() - argCount - 1] = v.value();
@@ -478,6 +694,25 @@ namespace lox {
             auto s = std::format("Undefined property {}", name.string());
             throw Exception(s.c_str(), nullptr);
         }
-        return call(toCallable(method.value()), argCount);
+        auto callable = toCallable(method.value());
+        if (argCount == 0 && inlineFieldGetter(callable)) {
+            return;
+        }
+        return call(std::move(callable), argCount);
+    }
+
+    // a getter is answered straight from the receiver's fields without a call frame, if the
+    // receiver doesn't have the field, the method is called as usual to get the usual lookup
+    bool VM::inlineFieldGetter(const Callable& callable) {
+        auto field = lox::getFunction(callable)->getFieldGetter();
+        if (!field.hasValue() || !is<SharedPtr<Instance>>(stack.peek())) {
+            return false;
+        }
+        auto value = borrow<Instance>(stack.peek())->getField(field.value());
+        if (!value.hasValue()) {
+            return false;
+        }
+        stack.top() = std::move(value.value());
+        return true;
     }
 }
\ No newline at end of file
@@ -2,7 +2,7 @@
 #define CPPLOX_VM_H_
 
 #include "chunk.h"
-#include "list.h"
+#include "native.h"
 #include "object.h"
 #include "stack.h"
 #include "string.h"
@@ -21,19 +21,33 @@ namespace lox {
     class VM {
     public:
         VM();
+        ~VM();
         InterpretResult interpret(const String& string);
         InterpretResult run();
+        // asks for a heap dump at the next safepoint, safe to call from a signal handler
+        static void requestHeapDump();
+        // caps what this VM's scripts can have allocated at once, going past it is a runtime error
+        void setMemoryLimit(size_t bytes);
+        size_t memoryUsed() const {
+            return budget.used;
+        }
+        size_t peakMemoryUsed() const {
+            return budget.peak;
+        }
 
         bool diagnosticMode = false;
         struct CallFrame {
         public:
-            CallFrame(Callable f, DynamicStack<Value>& stack, size_t offset = 0) : function(f), instructionPtr(lox::getFunction(f)->getChunk()->begin()), slots(&stack), offset(offset) {}
+            CallFrame(Callable f, DynamicStack<Value>& stack, size_t offset = 0) : function(std::move(f)), chunk(*lox::getFunction(function)->getChunk()), instructionPtr(chunk->begin()), slots(&stack), offset(offset) {}
             Chunk::InstructionIterator& getIp() {
                 return instructionPtr;
             }
+            const Chunk::InstructionIterator& getIp() const {
+                return instructionPtr;
+            }
 
             void push(Value v) {
-                slots->push(v);
+                slots->push(std::move(v));
             }
 
             const Value& peek(size_t index = 0) const {
@@ -44,20 +58,25 @@ namespace lox {
                 (*slots)[index + offset] = value;
             }
 
-            Callable getCallable() const {
+            const Callable& getCallable() const {
                 return function;
             }
 
-            SharedPtr<Function> getFunction() const {
+            const SharedPtr<Function>& getFunction() const {
                 return lox::getFunction(function);
             }
 
+            const Chunk& getChunk() const {
+                return *chunk;
+            }
+
             size_t getOffset() const {
                 return offset;
             }
 
         private:
             Callable function;
+            const Chunk* chunk;  // borrowed from the function, which the frame holds on to
             Chunk::InstructionIterator instructionPtr;
             DynamicStack<Value>* slots;
             size_t offset;
@@ -70,26 +89,43 @@ namespace lox {
         void verifyString(size_t stackIndex = 0) const;
         void defineGlobal(const Chunk& chunk, uint32_t constant);
         void defineNative(StringView name, NativeFunction::Func f, size_t argCount);
+        template <auto F>
+        void defineNative(StringView name) {
+            defineNative(name, &Native<F>::call, Native<F>::arity);
+        }
         void defineMethod(InternedString name, bool isInitializer = false);
         SharedPtr<UpValueObj> captureUpValue(DynamicStack<Value>::iterator);
         void closeUpValues(const DynamicStack<Value>::iterator iter);
+        void collectGarbage();
+        void settleBudget();
+        void dumpHeap();
+        void markStack();
+        static void markRoots(void* context, bool full);
         void bindMethod(SharedPtr<Class> cls, InternedString name);
+        static HeapProfiler::Site allocationSite(const void* vm);
 
         InterpretResult pushGlobal(const Chunk& chunk, uint32_t constant);
         InterpretResult assignGlobal(const Chunk& chunk, uint32_t constant);
 
         void pushLocal(size_t constant);
         void assignLocal(size_t constant);
-        void callValue(Value callee, int argCount);
+        Value& outerLocal(size_t constant);
+        void callValue(const Value& callee, int argCount);
         void call(Callable func, size_t argCount);
         void invoke(InternedString name, uint8_t argCount);
         void invokeFromClass(SharedPtr<Class> cls, InternedString name, uint8_t argCount);
+        bool inlineFieldGetter(const Callable& callable);
         double popNumber();
         void binaryOp(const Binary& bin);
         DynamicStack<Value> stack;
         DynamicStack<CallFrame> frames;
-        List<SharedPtr<UpValueObj>> openUpValues;
+        // the open upvalue of each stack slot, so capturing a slot again finds it without searching
+        Vector<SharedPtr<UpValueObj>> openUpValues;
+        size_t openUpValueCount = 0;
         Table<InternedString, Value> globals;
+        bool globalsWritten = true;  // the write barrier for globals
+        MemoryBudget budget;
+        bool collectedForBudget = false;  // the overdraft has had its collection, what it freed is being freed
     };
 }
 #endif
\ No newline at end of file
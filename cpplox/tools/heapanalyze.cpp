@@ -0,0 +1,297 @@
+// Reads a heap dump written by heapdump() or SIGUSR1 and says what is keeping memory alive: the
+// bytes each object retains, which are the ones that would go if it did, and where it is held from.
+// Retained sizes come from the dominator tree, worked out with Cooper, Harvey and Kennedy's
+// iterative algorithm over the graph with a made up root that points at all the real ones
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <print>
+#include <ranges>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../src/heapformat.h"
+
+namespace {
+    using lox::heapformat::Kind;
+
+    struct Node {
+        Kind kind;
+        uint64_t size;
+        std::string name;
+        std::vector<uint32_t> edges;
+        std::string root;  // what holds it, for a node that is a root
+    };
+
+    constexpr uint32_t UNVISITED = UINT32_MAX;
+    constexpr size_t DEFAULT_SHOWN = 20;
+
+    class Reader {
+    public:
+        explicit Reader(const char* path) : in(path, std::ios::binary | std::ios::ate) {
+            size = in.tellg();
+            in.seekg(0);
+        }
+
+        bool good() const {
+            return bool(in);
+        }
+
+        template <typename T>
+        T get() {
+            T value{};
+            in.read(reinterpret_cast<char*>(&value), sizeof(T));
+            return value;
+        }
+
+        std::string getString() {
+            auto length = get<uint32_t>();
+            if (!fits(length, 1)) {
+                in.setstate(std::ios::failbit);
+                return {};
+            }
+            std::string s(length, '\0');
+            in.read(s.data(), s.size());
+            return s;
+        }
+
+        // whether what is left of the file could hold count things of at least bytesEach, so a
+        // corrupt count is caught before anything is sized by it
+        bool fits(uint64_t count, size_t bytesEach) {
+            return in && count <= (size - uint64_t(in.tellg())) / bytesEach;
+        }
+
+        bool readHeader() {
+            char magic[sizeof(lox::heapformat::MAGIC)];
+            in.read(magic, sizeof(magic));
+            return in && std::memcmp(magic, lox::heapformat::MAGIC, sizeof(magic)) == 0 && get<uint32_t>() == lox::heapformat::VERSION;
+        }
+
+    private:
+        std::ifstream in;
+        uint64_t size = 0;
+    };
+
+    std::string describe(const Node& node) {
+        std::string kind = lox::heapformat::KIND_NAMES[size_t(node.kind)];
+        return node.name.empty() ? kind : kind + " " + node.name;
+    }
+
+    class Analysis {
+    public:
+        // the made up root is the last node
+        explicit Analysis(std::vector<Node> graph, const std::vector<uint32_t>& roots) : nodes(std::move(graph)), root(nodes.size()) {
+            nodes.push_back(Node{Kind::String, 0, "", roots, ""});
+            number();
+            dominate();
+            retain();
+        }
+
+        void report(size_t shown) const {
+            uint64_t total = 0;
+            for (auto node : order) {
+                total += nodes[node].size;
+            }
+            std::println("{} objects, {} bytes reachable", order.size() - 1, total);
+
+            // objects of the same kind and name, with what the group retains counted once
+            struct Group {
+                size_t count = 0;
+                uint64_t size = 0;
+                uint64_t retained = 0;
+            };
+            std::map<std::string, Group> groups;
+            for (auto node : order) {
+                if (node == root) {
+                    continue;
+                }
+                auto& group = groups[describe(nodes[node])];
+                group.count++;
+                group.size += nodes[node].size;
+                if (idom[node] == root || describe(nodes[idom[node]]) != describe(nodes[node])) {
+                    group.retained += retained[node];
+                }
+            }
+            std::vector<std::pair<std::string, Group>> byRetained(groups.begin(), groups.end());
+            std::ranges::sort(byRetained, std::greater{}, [](const auto& group) { return group.second.retained; });
+            std::println("\n{:<12}{:<12}{:<12}{}", "Retained", "Bytes", "Count", "Objects");
+            for (const auto& [name, group] : byRetained | std::views::take(shown)) {
+                std::println("{:<12}{:<12}{:<12}{}", group.retained, group.size, group.count, name);
+            }
+
+            std::vector<uint32_t> biggest(order.begin(), order.end());
+            std::erase(biggest, root);
+            std::ranges::sort(biggest, std::greater{}, [this](uint32_t node) { return retained[node]; });
+            std::println("\n{:<12}{:<12}{}", "Retained", "Bytes", "Object, and what holds it");
+            for (auto node : biggest | std::views::take(shown)) {
+                std::println("{:<12}{:<12}{}, {}", retained[node], nodes[node].size, describe(nodes[node]), holder(node));
+            }
+        }
+
+    private:
+        // the root at the top of the chain of dominators, and the dominator right above it
+        std::string holder(uint32_t node) const {
+            if (idom[node] == root) {
+                return "held by " + nodes[node].root;
+            }
+            auto top = node;
+            while (idom[top] != root) {
+                top = idom[top];
+            }
+            return "held by " + describe(nodes[idom[node]]) + " under " + nodes[top].root;
+        }
+
+        // postorder numbers from a depth first walk, without recursion as the graph can be deep
+        void number() {
+            postorder.assign(nodes.size(), UNVISITED);
+            std::vector<std::pair<uint32_t, size_t>> stack{{root, 0}};
+            std::vector<bool> seen(nodes.size());
+            seen[root] = true;
+            while (!stack.empty()) {
+                auto& [node, edge] = stack.back();
+                if (edge < nodes[node].edges.size()) {
+                    auto next = nodes[node].edges[edge++];
+                    if (!seen[next]) {
+                        seen[next] = true;
+                        stack.emplace_back(next, 0);
+                    }
+                } else {
+                    postorder[node] = order.size();
+                    order.push_back(node);
+                    stack.pop_back();
+                }
+            }
+            predecessors.resize(nodes.size());
+            for (auto node : order) {
+                for (auto next : nodes[node].edges) {
+                    predecessors[next].push_back(node);
+                }
+            }
+        }
+
+        uint32_t intersect(uint32_t a, uint32_t b) const {
+            while (a != b) {
+                while (postorder[a] < postorder[b]) {
+                    a = idom[a];
+                }
+                while (postorder[b] < postorder[a]) {
+                    b = idom[b];
+                }
+            }
+            return a;
+        }
+
+        void dominate() {
+            idom.assign(nodes.size(), UNVISITED);
+            idom[root] = root;
+            for (bool changed = true; changed;) {
+                changed = false;
+                for (auto node : order | std::views::reverse) {
+                    if (node == root) {
+                        continue;
+                    }
+                    uint32_t dominator = UNVISITED;
+                    for (auto predecessor : predecessors[node]) {
+                        if (idom[predecessor] != UNVISITED) {
+                            dominator = dominator == UNVISITED ? predecessor : intersect(predecessor, dominator);
+                        }
+                    }
+                    if (idom[node] != dominator) {
+                        idom[node] = dominator;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        // a node comes before its dominator in postorder, so its total is done when it is passed up
+        void retain() {
+            retained.assign(nodes.size(), 0);
+            for (auto node : order) {
+                retained[node] += nodes[node].size;
+                if (node != root) {
+                    retained[idom[node]] += retained[node];
+                }
+            }
+        }
+
+        std::vector<Node> nodes;
+        uint32_t root;
+        std::vector<uint32_t> order;  // the reachable nodes in postorder
+        std::vector<uint32_t> postorder;
+        std::vector<std::vector<uint32_t>> predecessors;
+        std::vector<uint32_t> idom;
+        std::vector<uint64_t> retained;
+    };
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc < 2 || argc > 3) {
+        std::println(std::cerr, "Usage: loxheap dump [count]");
+        return 64;
+    }
+    size_t shown = argc == 3 ? std::stoul(argv[2]) : DEFAULT_SHOWN;
+    Reader reader(argv[1]);
+    if (!reader.good()) {
+        std::println(std::cerr, "Can't open {}", argv[1]);
+        return 66;
+    }
+    if (!reader.readHeader()) {
+        std::println(std::cerr, "{} is not a heap dump", argv[1]);
+        return 65;
+    }
+    auto notHeapDump = [path = argv[1]] {
+        std::println(std::cerr, "{} is not a heap dump", path);
+        return 65;
+    };
+    // the smallest node is its kind, size, name length and edge count
+    constexpr size_t NODE_BYTES = sizeof(Kind) + sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    auto count = reader.get<uint32_t>();
+    if (!reader.fits(count, NODE_BYTES)) {
+        return notHeapDump();
+    }
+    std::vector<Node> nodes(count);
+    for (auto& node : nodes) {
+        node.kind = reader.get<Kind>();
+        if (size_t(node.kind) >= std::size(lox::heapformat::KIND_NAMES)) {
+            return notHeapDump();
+        }
+        node.size = reader.get<uint64_t>();
+        node.name = reader.getString();
+        auto edges = reader.get<uint32_t>();
+        if (!reader.fits(edges, sizeof(uint32_t))) {
+            return notHeapDump();
+        }
+        node.edges.resize(edges);
+        for (auto& edge : node.edges) {
+            edge = reader.get<uint32_t>();
+        }
+    }
+    auto rootCount = reader.get<uint32_t>();
+    if (!reader.fits(rootCount, 2 * sizeof(uint32_t))) {
+        return notHeapDump();
+    }
+    std::vector<uint32_t> roots(rootCount);
+    for (auto& root : roots) {
+        root = reader.get<uint32_t>();
+        auto name = reader.getString();
+        if (root < nodes.size() && nodes[root].root.empty()) {
+            nodes[root].root = name;
+        }
+    }
+    if (!reader.good()) {
+        std::println(std::cerr, "{} is cut short", argv[1]);
+        return 65;
+    }
+    auto outside = [&nodes](uint32_t index) { return index >= nodes.size(); };
+    if (std::ranges::any_of(roots, outside) || std::ranges::any_of(nodes, [&outside](const Node& node) { return std::ranges::any_of(node.edges, outside); })) {
+        return notHeapDump();
+    }
+    Analysis(std::move(nodes), roots).report(shown);
+    return 0;
+}